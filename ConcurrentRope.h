@@ -0,0 +1,290 @@
+#ifndef CONCURRENTROPE_H_INCLUDED
+#define CONCURRENTROPE_H_INCLUDED
+
+/*
+A rope shared between threads, read by any number of them without locking while it is replaced.
+
+The current version is a root pointer, published by writers with an atomic exchange.
+Readers protect the root they load with a hazard pointer, so a writer can't release it
+from under them, and then either take a reference (snapshot) or read through it in place (View).
+Writers queue replaced roots, and only release those that no reader has a hazard pointer to.
+Nodes themselves are immutable once shared, so nothing else needs protecting.
+*/
+
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "Rope.h"
+
+namespace WCRope
+{
+	// a process wide registry of hazard pointers, each Record protects one pointer at a time.
+	// Records are never freed, they are recycled once released
+	class HazardPointers
+	{
+		public:
+			class Record
+			{
+				public:
+					Record()
+						: mHazard(0)
+						, mInUse(false)
+						, mNext(0)
+					{
+					}
+
+					// the pointer must be re-checked (still reachable) after this,
+					// before it is relied on, as it may have been retired in the meantime
+					void Protect(const void* ptr) {
+						mHazard.store(ptr, std::memory_order_seq_cst);
+					}
+
+					void Clear() {
+						mHazard.store(0, std::memory_order_release);
+					}
+
+				private:
+					friend class HazardPointers;
+
+					std::atomic<const void*> mHazard;
+					std::atomic<bool> mInUse;
+					Record* mNext;
+			};
+
+			// a free record, from this thread's cache of them if it has one
+			static Record* Acquire()
+			{
+				LocalCache& cache = Local();
+				if (!cache.mRecords.empty())
+				{
+					Record* record = cache.mRecords.back();
+					cache.mRecords.pop_back();
+					return record;
+				}
+
+				for(Record* record = Head().load(std::memory_order_acquire);record;record = record->mNext)
+				{
+					bool inUse = false;
+					if (!record->mInUse.load(std::memory_order_relaxed) &&
+						record->mInUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+					{
+						return record;
+					}
+				}
+
+				Record* record = new Record();
+				record->mInUse.store(true, std::memory_order_relaxed);
+				record->mNext = Head().load(std::memory_order_relaxed);
+				while(!Head().compare_exchange_weak(record->mNext, record, std::memory_order_release, std::memory_order_relaxed))
+				{
+				}
+				return record;
+			}
+
+			// back to this thread's cache, cleared
+			static void Release(Record* record)
+			{
+				record->Clear();
+				Local().mRecords.push_back(record);
+			}
+
+			// the pointers currently protected, sorted
+			static void Protected(std::vector< const void* >& result)
+			{
+				result.clear();
+				for(Record* record = Head().load(std::memory_order_acquire);record;record = record->mNext)
+				{
+					const void* ptr = record->mHazard.load(std::memory_order_seq_cst);
+					if (ptr)
+						result.push_back(ptr);
+				}
+				std::sort(result.begin(), result.end());
+			}
+
+		private:
+			// hands a thread's cached records back to the registry when the thread exits
+			struct LocalCache
+			{
+				~LocalCache()
+				{
+					for(size_t i=0;i!=mRecords.size();++i)
+						mRecords[i]->mInUse.store(false, std::memory_order_release);
+				}
+
+				std::vector< Record* > mRecords;
+			};
+
+			static LocalCache& Local()
+			{
+				static thread_local LocalCache cache;
+				return cache;
+			}
+
+			static std::atomic<Record*>& Head()
+			{
+				static std::atomic<Record*> head(0);
+				return head;
+			}
+	};
+
+	// reference counts are atomic, as snapshots are shared between threads
+	template< typename CharT, typename Allocator = Allocation::HeapAllocator >
+	class ConcurrentRope
+	{
+		public:
+			typedef Rope<CharT, Synchronization::AtomicCount, Allocator> RopeType;
+
+			explicit ConcurrentRope(const RopeType& rope = RopeType())
+				: mRoot( Acquire(rope) )
+			{
+			}
+
+			// there must be no readers or writers left
+			~ConcurrentRope()
+			{
+				Release( mRoot.load() );
+				for(size_t i=0;i!=mRetired.size();++i)
+					Release( mRetired[i] );
+			}
+
+			// the current version, lock free, costing one reference count increment.
+			// The snapshot is unaffected by later writes
+			RopeType snapshot() const
+			{
+				HazardPointers::Record* record = HazardPointers::Acquire();
+				Rep* root = Load(*record);
+				root->AddRef();
+				HazardPointers::Release(record);
+
+				RopeType result;
+				result.mRopeRep = Ptr(root, Ptr::AdoptRef);
+				return result;
+			}
+
+			// scoped, read only, access to the current version, lock free and without
+			// touching any reference counts, so reads scale with the number of readers.
+			// The version is kept alive (by a hazard pointer) until the View is destroyed.
+			// Copies of rope() are ordinary references to the version, and outlive the View
+			class View
+			{
+				public:
+					explicit View(const ConcurrentRope& source)
+						: mRecord( HazardPointers::Acquire() )
+					{
+						mRope.mRopeRep = Ptr( source.Load(*mRecord), Ptr::AdoptRef );
+					}
+
+					~View()
+					{
+						// borrowed, not counted, so is handed back without a release
+						mRope.mRopeRep.Detach();
+						HazardPointers::Release(mRecord);
+					}
+
+					const RopeType& rope() const {
+						return mRope;
+					}
+
+					const RopeType* operator->() const {
+						return &mRope;
+					}
+
+				private:
+					View(const View&);
+					View& operator=(const View&);
+
+					HazardPointers::Record* mRecord;
+					RopeType mRope;
+			};
+
+			// publishes rope as the current version
+			void store(const RopeType& rope)
+			{
+				std::lock_guard<std::mutex> lock(mWriteLock);
+				Publish(rope);
+			}
+
+			// publishes fn(current version) as the current version,
+			// writers are serialised so no update is lost
+			template< typename Fn >
+			void update(Fn fn)
+			{
+				std::lock_guard<std::mutex> lock(mWriteLock);
+
+				// only writers change the root, and they hold the lock, so it can't be released under us
+				RopeType current;
+				current.mRopeRep = Ptr( mRoot.load(std::memory_order_acquire) );
+				Publish( fn( static_cast<const RopeType&>(current) ) );
+			}
+
+		private:
+			typedef typename RopeType::Rep Rep;
+			typedef typename RopeType::Ptr Ptr;
+
+			// replaced versions are held until this many are queued, and then released if unprotected
+			enum { RetireBatchSize = 32 };
+
+			ConcurrentRope(const ConcurrentRope&);
+			ConcurrentRope& operator=(const ConcurrentRope&);
+
+			// a counted reference to rope's tree (a copy of it, if rope is held inline)
+			static Rep* Acquire(const RopeType& rope)
+			{
+				return rope.Tree().Detach();
+			}
+
+			static void Release(Rep* rep)
+			{
+				Ptr released( rep, Ptr::AdoptRef );
+			}
+
+			// the current root, protected by record.
+			// Re-read after protecting it, to be sure it wasn't replaced (and retired) before it was protected
+			Rep* Load(HazardPointers::Record& record) const
+			{
+				Rep* root = mRoot.load(std::memory_order_acquire);
+				for(;;)
+				{
+					record.Protect(root);
+					Rep* check = mRoot.load(std::memory_order_seq_cst);
+					if (check==root)
+						return root;
+					root = check;
+				}
+			}
+
+			void Publish(const RopeType& rope)
+			{
+				mRetired.push_back( mRoot.exchange( Acquire(rope), std::memory_order_seq_cst ) );
+				if (mRetired.size()>=RetireBatchSize)
+					Reclaim();
+			}
+
+			// releases the retired versions no reader is looking at
+			void Reclaim()
+			{
+				HazardPointers::Protected(mProtected);
+				size_t kept = 0;
+				for(size_t i=0;i!=mRetired.size();++i)
+				{
+					if (std::binary_search( mProtected.begin(), mProtected.end(), static_cast<const void*>(mRetired[i]) ))
+						mRetired[kept++] = mRetired[i];
+					else
+						Release( mRetired[i] );
+				}
+				mRetired.resize(kept);
+			}
+
+			std::atomic<Rep*> mRoot;
+
+			// writers only
+			std::mutex mWriteLock;
+			std::vector< Rep* > mRetired;
+			std::vector< const void* > mProtected;
+	};
+}
+
+#endif
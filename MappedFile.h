@@ -0,0 +1,160 @@
+#ifndef MAPPEDFILE_H_INCLUDED
+#define MAPPEDFILE_H_INCLUDED
+
+/*
+A read only memory mapping of a whole file.
+Reference counted, the mapping is released when the last reference is dropped,
+so leaves referring into the file keep it mapped for as long as they are alive.
+Pages are only read in (and only count towards the process's memory use) when touched.
+*/
+
+#include <stddef.h>
+
+#ifdef WIN32
+#include "Windows.h"
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "RefCounter.h"
+#include "RefCountedObjPtr.h"
+
+namespace WCRope
+{
+	// leaves sharing a mapping may belong to ropes on different threads, so counting is always atomic
+	class MappedFile : public TRefCounter<Synchronization::AtomicCount>
+	{
+		public:
+			typedef RefCountedObjPtr<MappedFile> Ptr;
+
+			// maps the file at path, null if it can't be opened or mapped
+			static Ptr Open(const char* path)
+			{
+				MappedFile* file = new MappedFile();
+				if (!file->Map(path))
+				{
+					delete file;
+					return Ptr();
+				}
+				return Ptr(file);
+			}
+
+#ifndef WIN32
+			// maps the regular file open as fd, null if it isn't one or can't be mapped.
+			// fd is left open, the mapping doesn't need it
+			static Ptr Open(int fd)
+			{
+				MappedFile* file = new MappedFile();
+				if (!file->Map(fd))
+				{
+					delete file;
+					return Ptr();
+				}
+				return Ptr(file);
+			}
+#endif
+
+			const char* Data() const {
+				return mData;
+			}
+
+			size_t Size() const {
+				return mSize;
+			}
+
+			~MappedFile()
+			{
+				Unmap();
+			}
+
+		private:
+			MappedFile()
+				: mData(0)
+				, mSize(0)
+#ifdef WIN32
+				, mMapping(0)
+#endif
+			{
+			}
+
+			MappedFile(const MappedFile&);
+			MappedFile& operator=(const MappedFile&);
+
+#ifdef WIN32
+			bool Map(const char* path)
+			{
+				HANDLE file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+				if (file==INVALID_HANDLE_VALUE)
+					return false;
+
+				LARGE_INTEGER size;
+				bool result = GetFileSizeEx( file, &size ) != 0;
+				if (result && size.QuadPart>0)
+				{
+					// can't map an empty file, it's left as a null, empty, mapping
+					mMapping = CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 );
+					mData = mMapping ? static_cast<const char*>( MapViewOfFile( mMapping, FILE_MAP_READ, 0, 0, 0 ) ) : 0;
+					mSize = mData ? static_cast<size_t>(size.QuadPart) : 0;
+					result = mData!=0;
+				}
+				CloseHandle(file);
+				return result;
+			}
+
+			void Unmap()
+			{
+				if (mData)
+					UnmapViewOfFile(mData);
+				if (mMapping)
+					CloseHandle(mMapping);
+			}
+
+			HANDLE mMapping;
+#else
+			bool Map(const char* path)
+			{
+				const int fd = open( path, O_RDONLY | O_CLOEXEC );
+				if (fd<0)
+					return false;
+
+				// the mapping holds its own reference to the file
+				const bool result = Map(fd);
+				close(fd);
+				return result;
+			}
+
+			bool Map(int fd)
+			{
+				// pipes, devices and the like can't be mapped, or don't have a size to map
+				struct stat info;
+				bool result = fstat( fd, &info )==0 && S_ISREG(info.st_mode);
+				if (result && info.st_size>0)
+				{
+					// can't map an empty file, it's left as a null, empty, mapping
+					void* data = mmap( 0, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0 );
+					result = data!=MAP_FAILED;
+					if (result)
+					{
+						mData = static_cast<const char*>(data);
+						mSize = static_cast<size_t>(info.st_size);
+					}
+				}
+				return result;
+			}
+
+			void Unmap()
+			{
+				if (mData)
+					munmap( const_cast<char*>(mData), mSize );
+			}
+#endif
+
+			const char* mData;
+			size_t mSize;
+	};
+}
+
+#endif
@@ -0,0 +1,198 @@
+#ifndef NODEPOOL_H_INCLUDED
+#define NODEPOOL_H_INCLUDED
+
+/*
+Allocation policies for rope nodes, a policy provides
+    static void* Allocate(size_t bytes);
+    static void Deallocate(void* p, size_t bytes);
+where bytes passed to Deallocate is the size that was allocated.
+
+HeapAllocator goes straight to the global heap.
+
+PoolAllocator is a fixed size node pool.  Small blocks are rounded up to a size class
+and served from a thread local free list for that class, without locking.
+Free lists are refilled (and trimmed when they grow too long) in batches from a shared pool,
+which carves new blocks from slabs when it runs dry.  Slabs are never returned to the heap.
+Blocks larger than the largest size class go to the global heap.
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <new>
+
+#include "mutex.h"
+
+namespace Allocation
+{
+	class HeapAllocator
+	{
+		public:
+			static void* Allocate(size_t bytes) {
+				return ::operator new(bytes);
+			}
+
+			static void Deallocate(void* p, size_t) {
+				::operator delete(p);
+			}
+	};
+
+	class PoolAllocator
+	{
+		public:
+			static void* Allocate(size_t bytes)
+			{
+				if (bytes>MaxPooledSize)
+					return ::operator new(bytes);
+
+				const size_t sizeClass = SizeClass(bytes);
+				LocalCache& local = Local();
+				if (!local.mFree[sizeClass])
+					Refill(local, sizeClass);
+
+				FreeNode* node = local.mFree[sizeClass];
+				local.mFree[sizeClass] = node->mNext;
+				--local.mCount[sizeClass];
+				return node;
+			}
+
+			static void Deallocate(void* p, size_t bytes)
+			{
+				if (bytes>MaxPooledSize)
+				{
+					::operator delete(p);
+					return;
+				}
+
+				const size_t sizeClass = SizeClass(bytes);
+				LocalCache& local = Local();
+				FreeNode* node = static_cast<FreeNode*>(p);
+				node->mNext = local.mFree[sizeClass];
+				local.mFree[sizeClass] = node;
+				if (++local.mCount[sizeClass] > 2*BatchSize)
+					Trim(local, sizeClass, BatchSize);
+			}
+
+		private:
+			enum {
+				Granularity = 16,
+				MaxPooledSize = 256,
+				SizeClasses = MaxPooledSize/Granularity,
+				SlabSize = 64*1024,
+				BatchSize = 64
+			};
+
+			struct FreeNode
+			{
+				FreeNode* mNext;
+			};
+
+			// plain old data, so is still usable while threads (and the process) shut down
+			struct LocalCache
+			{
+				FreeNode* mFree[SizeClasses];
+				size_t mCount[SizeClasses];
+			};
+
+			struct Shared
+			{
+				Shared()
+					: mSlab(0)
+					, mSlabRemaining(0)
+				{
+					for(size_t i=0;i!=SizeClasses;++i)
+						mFree[i] = 0;
+				}
+
+				Synchronization::Mutex mLock;
+				FreeNode* mFree[SizeClasses];
+				char* mSlab;
+				size_t mSlabRemaining;
+			};
+
+			// hands a thread's free lists back to the shared pool when the thread exits
+			class Flusher
+			{
+				public:
+					explicit Flusher(LocalCache& cache)
+						: mCache(cache)
+					{ }
+
+					~Flusher() {
+						for(size_t i=0;i!=SizeClasses;++i)
+							Trim(mCache, i, mCache.mCount[i]);
+					}
+
+				private:
+					LocalCache& mCache;
+			};
+
+			static size_t SizeClass(size_t bytes) {
+				return bytes ? (bytes-1)/Granularity : 0;
+			}
+
+			static LocalCache& Local()
+			{
+				static thread_local LocalCache cache = { { 0 }, { 0 } };
+				static thread_local Flusher flusher(cache);
+				return cache;
+			}
+
+			// never destroyed, nodes may be released during static destruction
+			static Shared& GetShared()
+			{
+				static Shared* shared = new Shared();
+				return *shared;
+			}
+
+			static void Refill(LocalCache& local, size_t sizeClass)
+			{
+				const size_t blockSize = (sizeClass+1)*Granularity;
+				Shared& shared = GetShared();
+				Synchronization::MutexLock lock( shared.mLock );
+
+				for(size_t i=0;i!=BatchSize;++i)
+				{
+					FreeNode* node = shared.mFree[sizeClass];
+					if (node)
+					{
+						shared.mFree[sizeClass] = node->mNext;
+					}
+					else
+					{
+						if (shared.mSlabRemaining<blockSize)
+						{
+							// the tail of the old slab is too small for this class, and is abandoned
+							shared.mSlab = static_cast<char*>(::operator new(SlabSize));
+							shared.mSlabRemaining = SlabSize;
+						}
+						node = reinterpret_cast<FreeNode*>(shared.mSlab);
+						shared.mSlab += blockSize;
+						shared.mSlabRemaining -= blockSize;
+					}
+					node->mNext = local.mFree[sizeClass];
+					local.mFree[sizeClass] = node;
+					++local.mCount[sizeClass];
+				}
+			}
+
+			static void Trim(LocalCache& local, size_t sizeClass, size_t count)
+			{
+				if (!count)
+					return;
+
+				Shared& shared = GetShared();
+				Synchronization::MutexLock lock( shared.mLock );
+				for(size_t i=0;i!=count && local.mFree[sizeClass];++i)
+				{
+					FreeNode* node = local.mFree[sizeClass];
+					local.mFree[sizeClass] = node->mNext;
+					--local.mCount[sizeClass];
+
+					node->mNext = shared.mFree[sizeClass];
+					shared.mFree[sizeClass] = node;
+				}
+			}
+	};
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef RECLAIMER_H_INCLUDED
+#define RECLAIMER_H_INCLUDED
+
+/*
+Reclamation policies for dead rope nodes.
+
+By default a tree is taken apart by whichever thread drops the last reference to it,
+which for a large rope is a long stretch of frees on what may be a latency critical thread.
+Installing a Reclaimer on a thread (with a ReclaimScope) hands the dead trees released
+on that thread to the Reclaimer instead, which destroys them later:
+
+DeferredReclaimer queues them on the thread itself, until it is drained at a safe point.
+BackgroundReclaimer queues them for a thread of its own. Only nodes with thread safe
+reference counts may be passed to it, the others are still destroyed inline.
+
+Dead nodes are held type erased, the Reclaimer only knows how to finish them off.
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Reclamation
+{
+	// a dead node, and the function that destroys it
+	struct DeadNode
+	{
+		void* mNode;
+		void (*mDestroy)(void*);
+
+		void Destroy() const {
+			mDestroy(mNode);
+		}
+	};
+
+	class Reclaimer
+	{
+		public:
+			// takes node, returns false if it should be destroyed inline instead.
+			// threadSafe is whether the node (and the nodes it refers to) may be released on another thread
+			virtual bool Take(const DeadNode& node, bool threadSafe)=0;
+
+			// passes node to the calling thread's Reclaimer, if it has one
+			static bool Defer(void* node, void (*destroy)(void*), bool threadSafe)
+			{
+				Reclaimer* reclaimer = Current();
+				if (!reclaimer)
+					return false;
+				const DeadNode dead = { node, destroy };
+				return reclaimer->Take(dead, threadSafe);
+			}
+
+			// the Reclaimer installed on the calling thread, null to destroy inline
+			static Reclaimer*& Current() {
+				static thread_local Reclaimer* reclaimer = 0;
+				return reclaimer;
+			}
+
+		protected:
+			Reclaimer() { }
+			virtual ~Reclaimer() { }
+
+		private:
+			Reclaimer(const Reclaimer&);
+			Reclaimer& operator=(const Reclaimer&);
+	};
+
+	// installs a Reclaimer on the calling thread for the lifetime of the scope,
+	// a null reclaimer restores inline destruction
+	class ReclaimScope
+	{
+		public:
+			explicit ReclaimScope(Reclaimer* reclaimer)
+				: mPrevious(Reclaimer::Current())
+			{
+				Reclaimer::Current() = reclaimer;
+			}
+
+			explicit ReclaimScope(Reclaimer& reclaimer)
+				: mPrevious(Reclaimer::Current())
+			{
+				Reclaimer::Current() = &reclaimer;
+			}
+
+			~ReclaimScope()
+			{
+				Reclaimer::Current() = mPrevious;
+			}
+
+		private:
+			ReclaimScope(const ReclaimScope&);
+			ReclaimScope& operator=(const ReclaimScope&);
+
+			Reclaimer* mPrevious;
+	};
+
+	// holds dead nodes until Drain is called, for use by a single thread
+	class DeferredReclaimer : public Reclaimer
+	{
+		public:
+			DeferredReclaimer() { }
+
+			// must no longer be installed
+			~DeferredReclaimer()
+			{
+				Drain();
+			}
+
+			virtual bool Take(const DeadNode& node, bool)
+			{
+				mPending.push_back(node);
+				return true;
+			}
+
+			// destroys everything queued, returns the number of dead trees destroyed.
+			// Their nodes are released inline, rather than queued again
+			size_t Drain()
+			{
+				ReclaimScope inlineScope(0);
+				size_t drained = 0;
+				while(!mPending.empty())
+				{
+					const DeadNode node = mPending.back();
+					mPending.pop_back();
+					node.Destroy();
+					++drained;
+				}
+				return drained;
+			}
+
+			size_t Pending() const {
+				return mPending.size();
+			}
+
+		private:
+			std::vector< DeadNode > mPending;
+	};
+
+	// destroys dead nodes on a thread of its own
+	class BackgroundReclaimer : public Reclaimer
+	{
+		public:
+			BackgroundReclaimer()
+				: mQueued(0)
+				, mDestroyed(0)
+				, mStop(false)
+				, mThread( [this]() { Work(); } )
+			{
+			}
+
+			// destroys anything still queued, must no longer be installed on any thread
+			~BackgroundReclaimer()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mLock);
+					mStop = true;
+				}
+				mWake.notify_one();
+				mThread.join();
+			}
+
+			// a reclaimer shared by the whole process, created on first use.
+			// Never destroyed, nodes may be released during static destruction
+			static BackgroundReclaimer& Default()
+			{
+				static BackgroundReclaimer* reclaimer = new BackgroundReclaimer();
+				return *reclaimer;
+			}
+
+			virtual bool Take(const DeadNode& node, bool threadSafe)
+			{
+				if (!threadSafe)
+					return false;
+				{
+					std::lock_guard<std::mutex> lock(mLock);
+					mPending.push_back(node);
+					++mQueued;
+				}
+				mWake.notify_one();
+				return true;
+			}
+
+			// waits until everything queued so far has been destroyed
+			void Flush()
+			{
+				std::unique_lock<std::mutex> lock(mLock);
+				const size_t queued = mQueued;
+				mDone.wait(lock, [this, queued]() { return mDestroyed>=queued; });
+			}
+
+		private:
+			void Work()
+			{
+				std::vector< DeadNode > batch;
+				std::unique_lock<std::mutex> lock(mLock);
+				for(;;)
+				{
+					mWake.wait(lock, [this]() { return mStop || !mPending.empty(); });
+					if (mPending.empty())
+						return;
+
+					// destroyed outside the lock, so releasing threads aren't held up
+					batch.swap(mPending);
+					lock.unlock();
+					for(size_t i=0;i!=batch.size();++i)
+						batch[i].Destroy();
+					lock.lock();
+
+					mDestroyed += batch.size();
+					batch.clear();
+					mDone.notify_all();
+				}
+			}
+
+			std::mutex mLock;
+			std::condition_variable mWake;
+			std::condition_variable mDone;
+			std::vector< DeadNode > mPending;
+			size_t mQueued;
+			size_t mDestroyed;
+			bool mStop;
+
+			// last, started once everything else is initialised
+			std::thread mThread;
+	};
+}
+
+#endif
@@ -5,30 +5,53 @@
 a pointer to an object that supports reference counting.  
 Increments reference count on auqisition, decrements it on release.
 Deletes object if ref count reaches zero.
+
+The pointer itself is not synchronised (as per a raw pointer, don't modify one instance from 
+several threads at once), thread safety of the count is the job of the pointed to object.
+MutexT is retained for source compatibility only.
 */
 
+#include <assert.h>
+#include <utility>
+
 #include "mutex.h"
 
+// disposes of an object once its count reaches zero.
+// Overload (in the object's namespace, it's found by argument dependent lookup) 
+// for types that aren't released with delete
+template<typename T>
+inline void DestroyRefCounted(T* ptr)
+{
+    delete ptr;
+}
+
 template<typename T, typename MutexT=Synchronization::NullMutex>
 class RefCountedObjPtr
 {
 public:
+    // tag for taking over a reference that has already been counted (see Detach)
+    enum AdoptTag { AdoptRef };
+
     explicit RefCountedObjPtr(T* ptr = 0);
+    RefCountedObjPtr(T* ptr, AdoptTag);
     RefCountedObjPtr(const RefCountedObjPtr<T, MutexT>& rhs);
+    RefCountedObjPtr(RefCountedObjPtr<T, MutexT>&& rhs);
     ~RefCountedObjPtr();
     T& operator*() const;
     T* operator->() const;
     RefCountedObjPtr<T, MutexT>& operator=(const RefCountedObjPtr<T, MutexT>& rhs);
+    RefCountedObjPtr<T, MutexT>& operator=(RefCountedObjPtr<T, MutexT>&& rhs);
     RefCountedObjPtr<T, MutexT>& operator=(T* ptr);
 	bool operator==(const RefCountedObjPtr<T>& rhs)const;
     bool operator==(const T* rhs)const;
     bool operator<(const RefCountedObjPtr<T>& rhs)const;
 	bool operator!=(const RefCountedObjPtr<T>& rhs)const;
     T* GetPtr() const;
+    T* Detach();
+    void swap(RefCountedObjPtr<T, MutexT>& rhs);
 
 	operator bool () const;
 private:
-    mutable MutexT mLock;
 	T* m_ptr;
 
 	//const - modifies body of pointed to object only
@@ -44,6 +67,13 @@ inline RefCountedObjPtr<T, MutexT>::RefCountedObjPtr(T* ptr)
     Acquire();
 }
 
+//Construct from a raw pointer whose reference is already counted, ie from Detach()
+template<typename T, typename MutexT>
+inline RefCountedObjPtr<T, MutexT>::RefCountedObjPtr(T* ptr, AdoptTag) 
+    : m_ptr(ptr)
+{
+}
+
 //Copy constructor.
 template<typename T, typename MutexT>
 inline RefCountedObjPtr<T, MutexT>::RefCountedObjPtr(const RefCountedObjPtr<T, MutexT>& rhs) 
@@ -52,6 +82,14 @@ inline RefCountedObjPtr<T, MutexT>::RefCountedObjPtr(const RefCountedObjPtr<T, M
     Acquire();		
 }
 
+//Move constructor, steals the reference so doesn't touch the count
+template<typename T, typename MutexT>
+inline RefCountedObjPtr<T, MutexT>::RefCountedObjPtr(RefCountedObjPtr<T, MutexT>&& rhs) 
+    : m_ptr(rhs.m_ptr)
+{
+    rhs.m_ptr = 0;
+}
+
 //Destructor method.
 template<typename T, typename MutexT>
 inline RefCountedObjPtr<T, MutexT>::~RefCountedObjPtr()
@@ -62,7 +100,6 @@ inline RefCountedObjPtr<T, MutexT>::~RefCountedObjPtr()
 template<typename T, typename MutexT>
 inline void RefCountedObjPtr<T, MutexT>::Acquire()const
 {
-    Synchronization::TMutexLock<MutexT> lock( mLock );
     if (m_ptr){
         m_ptr->AddRef();
     }
@@ -92,21 +129,32 @@ inline RefCountedObjPtr<T, MutexT>& RefCountedObjPtr<T, MutexT>::operator=(const
     return *this;
 }
 
+template<typename T, typename MutexT>
+inline RefCountedObjPtr<T, MutexT>& RefCountedObjPtr<T, MutexT>::operator=(RefCountedObjPtr<T, MutexT>&& rhs)
+{
+    if (this != &rhs){
+        Release();
+        m_ptr = rhs.m_ptr;
+        rhs.m_ptr = 0;
+    }
+    return *this;
+}
+
 template<typename T, typename MutexT>
 inline RefCountedObjPtr<T, MutexT>& RefCountedObjPtr<T, MutexT>::operator=(T* ptr)
 {
     RefCountedObjPtr temp(ptr);
-    return *this = temp;
+    swap(temp);
+    return *this;
 }
 
 
 template<typename T, typename MutexT>
 inline void RefCountedObjPtr<T, MutexT>::Release()
 {
-    Synchronization::TMutexLock<MutexT> lock( mLock );
     if (m_ptr){
         if (m_ptr->DecRef()==0){
-    	   delete m_ptr;		   
+    	   DestroyRefCounted(m_ptr);		   
         }
 #ifdef DEBUG
 		m_ptr = 0xdeadbeef;
@@ -145,6 +193,22 @@ inline T* RefCountedObjPtr<T, MutexT>::GetPtr() const
     return m_ptr;
 }
 
+//Gives up ownership of the pointer without releasing it, 
+//the caller becomes responsible for the reference (see AdoptRef)
+template<typename T, typename MutexT>
+inline T* RefCountedObjPtr<T, MutexT>::Detach()
+{
+    T* ptr = m_ptr;
+    m_ptr = 0;
+    return ptr;
+}
+
+template<typename T, typename MutexT>
+inline void RefCountedObjPtr<T, MutexT>::swap(RefCountedObjPtr<T, MutexT>& rhs)
+{
+    std::swap(m_ptr, rhs.m_ptr);
+}
+
 template<typename T, typename MutexT>
 inline RefCountedObjPtr<T, MutexT>::operator bool () const
 {
@@ -11,6 +11,8 @@ Do NOT, I repeat DO NOT use a pointer to a RefCounter to delete an object derive
 */
 
 #include <assert.h>
+#include <stddef.h>
+#include <atomic>
 
 #include "mutex.h"
 
@@ -28,7 +30,8 @@ protected:
     ~TRefCounter();
     
 private:
-    MutexT mLock;
+    // mutable, reads of the count lock too
+    mutable MutexT mLock;
     size_t m_refCount;
 };
 
@@ -61,9 +64,11 @@ inline size_t TRefCounter<MutexT>::DecRef()
 }
 
 //Is there only one reference to the object?
+//Locked, so that the last release by another thread happens before the object is modified in place
 template<typename MutexT>
 inline bool TRefCounter<MutexT>::IsUnique() const
 {
+    Synchronization::TMutexLock<MutexT> lock( mLock );
     return m_refCount==1;
 }
 
@@ -71,9 +76,48 @@ inline bool TRefCounter<MutexT>::IsUnique() const
 template<typename MutexT>
 inline size_t TRefCounter<MutexT>::GetRefCount() const
 {
+    Synchronization::TMutexLock<MutexT> lock( mLock );
     return m_refCount;
 }
 
+// lock free specialisation, 
+// increments need no ordering (a reference can only be copied from an existing one),
+// decrements are acquire/release so that the thread that deletes an object sees all writes to it
+template<>
+class TRefCounter<Synchronization::AtomicCount>
+{
+public:
+	size_t AddRef() {
+		return m_refCount.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
+
+	size_t DecRef() {
+		const size_t was = m_refCount.fetch_sub(1, std::memory_order_acq_rel);
+		assert(was>0);
+		return was - 1;
+	}
+
+	bool IsUnique() const {
+		return m_refCount.load(std::memory_order_acquire)==1;
+	}
+
+	size_t GetRefCount() const {
+		return m_refCount.load(std::memory_order_relaxed);
+	}
+
+protected:
+	TRefCounter()
+		: m_refCount(0)
+	{ }
+
+	~TRefCounter() {
+		assert( m_refCount.load(std::memory_order_relaxed) == 0 );
+	}
+
+private:
+	std::atomic<size_t> m_refCount;
+};
+
 typedef TRefCounter<> RefCounter;
 
 #endif
\ No newline at end of file
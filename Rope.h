@@ -5,981 +5,3816 @@
 #include <vector>
 #include <algorithm> //for std::min
 #include <iterator>
+#include <atomic>
+#include <functional> //for std::hash
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdint.h>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string.h> //for memcpy
+
+#ifndef WIN32
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#include <fstream>
+#endif
 
 #include "RefCounter.h"
 #include "RefCountedObjPtr.h"
+#include "NodePool.h"
+#include "MappedFile.h"
+#include "TaskPool.h"
+#include "Reclaimer.h"
 
 #undef min
 #undef max
 
 #define CHUNK_SIZE 32
 
+// a concatenation that leaves the tree this many levels deeper than the 
+// Fibonacci bound (see RopeRep::IsBalanced) triggers an automatic re-balance
+#ifndef ROPE_BALANCE_SLACK
+#define ROPE_BALANCE_SLACK 8
+#endif
+
+// size of the scratch buffer spans are synthesized in, for leaves without contiguous storage
+#define SPAN_BUFFER_SIZE 256
+
+// spans per writev call, and characters buffered for leaves without contiguous storage (see Rope::write_to)
+#define WRITE_BATCH_SIZE 1024
+#define WRITE_BUFFER_SIZE (16*1024)
+
+// the parallel_ algorithms split work into pieces of (at most) this many characters
+#ifndef PARALLEL_GRAIN_SIZE
+#define PARALLEL_GRAIN_SIZE (256*1024)
+#endif
+
+// characters per leaf built by a RopeBuilder
+#ifndef BUILDER_LEAF_SIZE
+#define BUILDER_LEAF_SIZE 4096
+#endif
+
+// concatenations at least this deep are handed to the releasing thread's Reclaimer, if it has one,
+// rather than being taken apart inline (see Reclaimer.h)
+#ifndef DEFERRED_RECLAIM_DEPTH
+#define DEFERRED_RECLAIM_DEPTH 8
+#endif
+
+// bytes of storage in each Rope handle, strings that fit (less a byte for their length) 
+// are held there rather than in a tree, so short strings need no allocation
+#ifndef ROPE_INLINE_SIZE
+#define ROPE_INLINE_SIZE 24
+#endif
+
+// a slice of a leaf is copied, rather than referring to the leaf, if the leaf holds more than this 
+// many times the slice's characters, so a substring keeps at most this multiple of its length alive
+#ifndef ROPE_SLICE_SHARE_RATIO
+#define ROPE_SLICE_SHARE_RATIO 4
+#endif
+
+// characters per leaf when a memory mapped file is split into a tree (see Rope::open_file)
+#ifndef MAPPED_LEAF_SIZE
+#define MAPPED_LEAF_SIZE (64*1024)
+#endif
+
+// define ROPE_TAGGED_DISPATCH to have the hot read paths (indexing, descending the tree, iteration) 
+// switch on each node's type tag and call the concrete rep directly, rather than calling virtually
+
 namespace WCRope 
 {
-	template< typename CharT, typename SynchronizationPrimative>
+	// polynomial string hash, sum of (s[i]+1) * Base^(n-1-i) modulo the Mersenne prime 2^61-1.
+	// The hash of a concatenation follows from the hashes (and lengths) of its parts, 
+	// so a tree's hash is composed from its nodes' without rescanning the characters
+	class PolynomialHash
+	{
+		public:
+			static const uint64_t Modulus = (uint64_t(1)<<61)-1;
+			static const uint64_t Base = 0x0123456789abcdefull;
+
+			template< typename CharT >
+			static uint64_t Append(uint64_t hash, const CharT* data, size_t n)
+			{
+				typedef typename std::make_unsigned<CharT>::type UnsignedChar;
+				for(size_t i=0;i!=n;++i)
+					hash = Add( Mul(hash, Base), uint64_t(UnsignedChar(data[i]))+1 );
+				return hash;
+			}
+
+			// hash of lhs followed by rhs
+			static uint64_t Combine(uint64_t lhs, uint64_t rhs, size_t rhsLength) {
+				return Add( Mul(lhs, Power(rhsLength)), rhs );
+			}
+
+			// hash of count repetitions of a sequence of length period with hash 'hash',
+			// hash * (1 + x + x^2 .. x^(count-1)) where x = Base^period
+			static uint64_t Repeat(uint64_t hash, size_t period, size_t count)
+			{
+				uint64_t sum = 0, offset = 1;
+				uint64_t blockSum = 1, blockPower = Power(period);
+				for(;count;count>>=1)
+				{
+					if (count&1)
+					{
+						sum = Add( sum, Mul(offset, blockSum) );
+						offset = Mul( offset, blockPower );
+					}
+					blockSum = Add( blockSum, Mul(blockPower, blockSum) );
+					blockPower = Mul( blockPower, blockPower );
+				}
+				return Mul(hash, sum);
+			}
+
+			// Base^n
+			static uint64_t Power(size_t n)
+			{
+				uint64_t result = 1, square = Base;
+				for(;n;n>>=1)
+				{
+					if (n&1)
+						result = Mul(result, square);
+					square = Mul(square, square);
+				}
+				return result;
+			}
+
+		private:
+			static uint64_t Add(uint64_t a, uint64_t b) {
+				const uint64_t sum = a+b;
+				return sum>=Modulus ? sum-Modulus : sum;
+			}
+
+			// a*b mod 2^61-1, from 32 bit halves so doesn't need a 128 bit type
+			static uint64_t Mul(uint64_t a, uint64_t b)
+			{
+				const uint64_t aHi = a>>32, aLo = a&0xffffffffu;
+				const uint64_t bHi = b>>32, bLo = b&0xffffffffu;
+				const uint64_t hi = aHi*bHi;
+				const uint64_t mid = aHi*bLo + aLo*bHi;
+				const uint64_t lo = aLo*bLo;
+
+				// 2^64 == 8 and 2^61 == 1 (mod 2^61-1)
+				const uint64_t sum = (hi<<3) + (mid>>29) + ((mid&((uint64_t(1)<<29)-1))<<32) + (lo>>61) + (lo&Modulus);
+				const uint64_t result = (sum&Modulus) + (sum>>61);
+				return result>=Modulus ? result-Modulus : result;
+			}
+	};
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator = Allocation::HeapAllocator >
 	class RopeRep : public TRefCounter<SynchronizationPrimative>
 	{
 		public:
 			typedef RefCountedObjPtr<RopeRep> Ptr;
 			typedef std::basic_string<CharT> StringType;
+
+			enum NodeType { NullNode, StringNode, ConCatNode, RepeatedSequenceNode, SubStrNode, FillNode, MappedNode };
 			
 			virtual CharT Get(size_t offset)const=0;
-			virtual size_t Length()const=0;			
-			virtual size_t TreeDepth()const=0;
 
-			virtual StringType GetString() const=0;
+			// length and depth are held inline, so are available without a virtual call
+			size_t Length()const {
+				return mLength;
+			}
+
+			size_t TreeDepth()const {
+				return mDepth;
+			}
+
+			NodeType Type()const {
+				return NodeType(mType);
+			}
+
+			// non-virtual entry points for the hot paths, see ROPE_TAGGED_DISPATCH
+			CharT At(size_t offset)const;
+			std::pair< RopeRep*, RopeRep* > ChildPtrs()const;
+
+			// bytes allocated for the node, including any inline storage
+			virtual size_t AllocationSize()const=0;
+
+			// PolynomialHash of the node's characters, computed on first use and then cached.
+			// Racing threads compute the same value, so the cache needs no lock
+			uint64_t Hash()const {
+				uint64_t hash = mHash.load(std::memory_order_relaxed);
+				if (hash==NotHashed)
+				{
+					hash = ComputeHash();
+					mHash.store(hash, std::memory_order_relaxed);
+				}
+				return hash;
+			}
+
+			// true, and the hash, if it has already been computed
+			bool CachedHash(uint64_t& hash)const {
+				hash = mHash.load(std::memory_order_relaxed);
+				return hash!=NotHashed;
+			}
+
+			// for appending in place, lengthens a node whose rightmost leaf has grown by n.
+			// Only for a node that nothing else refers to (see Rope::append)
+			void AddLength(size_t n) {
+				mLength += n;
+				InvalidateHash();
+			}
+
+			// copies the characters [pos, pos+len) to out
+			virtual void Copy(size_t pos, size_t len, CharT* out) const=0;
+
+			// flattens the string, one allocation and one pass over the tree
+			virtual StringType GetString() const {
+				StringType result(Length(), CharT());
+				if (!result.empty())
+					Copy(0, result.size(), &result[0]);
+				return result;
+			}
+
+			// returns a pointer to the characters starting at pos, and shortens len to 
+			// the number of them that are contiguous there.  Leaves without contiguous 
+			// storage synthesize (at most bufferSize characters of) the span in buffer, 
+			// so with a bufferSize of 0 only spans of the node's own storage are returned
+			virtual const CharT* GetSpan(size_t pos, size_t& len, CharT* buffer, size_t bufferSize) const {
+				len = std::min(len, bufferSize);
+				Copy(pos, len, buffer);
+				return buffer;
+			}
 
 			virtual std::pair< Ptr, Ptr > GetChildren()const {
 				assert(false);
 				return std::pair< Ptr, Ptr >(Ptr(0),Ptr(0));
 			}
 
-			virtual ~RopeRep(){}
+			// as per GetChildren, but borrowed rather than ref counted, 
+			// only valid for as long as this node is kept alive.
+			// Read paths use these, so don't touch shared counters while descending
+			virtual std::pair< RopeRep*, RopeRep* > GetChildPtrs()const {
+				assert(false);
+				return std::pair< RopeRep*, RopeRep* >(0,0);
+			}
 
-	};
+			virtual ~RopeRep(){}
 
-	template< typename CharT, typename SynchronizationPrimative >
-	class NullRep : public RopeRep<CharT, SynchronizationPrimative>
-	{
-	public:
-		typedef typename RopeRep<CharT, SynchronizationPrimative>::Ptr Ptr;
-		typedef typename RopeRep<CharT, SynchronizationPrimative>::StringType StringType;
+			// nodes are allocated through the Allocator policy
+			static void* operator new(size_t bytes) {
+				return Allocator::Allocate(bytes);
+			}
 
-		virtual CharT Get(size_t offset)const{
-			assert(false); return 0;
-		}
-		virtual size_t Length()const{
-			return 0;
-		}
-		virtual size_t TreeDepth()const{
-			return 1;
-		}
-		virtual typename RopeRep<CharT, SynchronizationPrimative>::StringType GetString() const {
-			return typename RopeRep<CharT, SynchronizationPrimative>::StringType();
-		}
-		
-		// saves having to create one on the heap every time
-		static Ptr Instance();
-	};
-	
-	// feels so wrong
-	template< typename CharT, typename SynchronizationPrimative >
-	typename NullRep<CharT, SynchronizationPrimative>::Ptr NullRep<CharT, SynchronizationPrimative>::Instance()
-	{
-		static typename RopeRep<CharT, SynchronizationPrimative>::Ptr r( 
-			new NullRep<CharT, SynchronizationPrimative>()
-		);
-		return r;
-	}
+			static void* operator new(size_t, void* memory) {
+				return memory;
+			}
 
-	template< typename CharSet, typename SynchronizationPrimative >
-	class StringRep : public RopeRep< CharSet, SynchronizationPrimative >
-	{
-		public:
-            typedef typename RopeRep<CharSet, SynchronizationPrimative>::Ptr Ptr;
-            typedef typename RopeRep<CharSet, SynchronizationPrimative>::StringType StringType;
-                        
-			StringRep( StringType const & str )
-				: mStr(str)
-			{                
+			static void operator delete(void* p, size_t bytes) {
+				Allocator::Deallocate(p, bytes);
 			}
 
-			StringRep( StringType const & lhs,  StringType const & rhs )
-			{                
-				mStr.reserve( lhs.size() + rhs.size() );
-				mStr = lhs;
-				mStr += rhs;
+			static void operator delete(void*, void*) {
 			}
 
-			template< typename Itr >
-			StringRep( Itr begin,  Itr end )
-				: mStr( begin, end )
-			{
+			// releases the node back to the Allocator, called when the last reference is dropped
+			void Destroy() {
+				const size_t bytes = AllocationSize();
+				this->~RopeRep();
+				Allocator::Deallocate(this, bytes);
 			}
 
-			virtual CharSet Get(size_t offset) const {
-				assert(offset<mStr.length());
-				return mStr[offset];
+			// as per Destroy, for a Reclaimer, which holds dead nodes type erased
+			static void DestroyErased(void* node) {
+				static_cast<RopeRep*>(node)->Destroy();
 			}
 
-			virtual size_t Length() const {
-				return mStr.size();
+		protected:
+			RopeRep( NodeType type, size_t length, size_t depth )
+				: mLength(length)
+				, mDepth(static_cast<unsigned int>(depth))
+				, mType(static_cast<unsigned char>(type))
+				, mHash(NotHashed)
+			{
 			}
 
-			virtual size_t TreeDepth()const {
-				return 1;
+			// derives the hash, by default from a pass over the characters
+			virtual uint64_t ComputeHash()const {
+				uint64_t hash = 0;
+				ForEachChunk(0, Length(), [&hash](const CharT* data, size_t n) -> bool {
+					hash = PolynomialHash::Append(hash, data, n);
+					return true;
+				});
+				return hash;
 			}
 
-			virtual StringType GetString() const {
-				return mStr;
+			// must be called if the node's characters are changed in place
+			void InvalidateHash() {
+				mHash.store(NotHashed, std::memory_order_relaxed);
 			}
 
+			size_t mLength;
+
 		private:
-            StringType mStr;
-	};
+			// hashes are less than PolynomialHash::Modulus, so this is never a valid hash
+			static const uint64_t NotHashed = ~uint64_t(0);
+
+			const unsigned int mDepth;
+			const unsigned char mType;
+			mutable std::atomic<uint64_t> mHash;
 
-	template< typename CharSet, typename SynchronizationPrimative >
-	class ConCatRep : public RopeRep< CharSet, SynchronizationPrimative >
-	{
 		public:
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::Ptr Ptr;
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::StringType StringType;			
-                        
-			ConCatRep(  Ptr const & lhs, Ptr const & rhs )
-				: mLength(lhs->Length() + rhs->Length())
-				, mDepth(std::max(lhs->TreeDepth(), rhs->TreeDepth())+1)
-				, mLhs(lhs)
-				, mRhs(rhs)
+			// calls fn(leaf, leafPos, leafLen) for each leaf overlapping [pos, pos+len), in order, 
+			// where leafPos/leafLen are the part of the leaf in range.
+			// Stops (and returns false) as soon as fn returns false.
+			// Flattens the callstack, deep trees don't overflow the stack
+			template< typename Fn >
+			bool ForEachLeaf(size_t pos, size_t len, Fn fn) const
 			{
-			}
+				assert(pos+len<=Length());
+				NodeStack stack;
 
-			~ConCatRep()
-			{
-				// this code flattens the callstack by "unwinding" the destruction of trees
-				// prevents a stack overflow if you concatinate, ie 1000000 strings
-				if (mLhs->IsUnique() || mRhs->IsUnique())
+				const RopeRep* node = this;
+				while(len)
 				{
-					std::vector< Ptr > list;
-					list.reserve(mDepth);
-					
-					list.push_back(mLhs);
-					mLhs = 0;
-
-					list.push_back(mRhs);
-					mRhs = 0;
-
-					size_t i=0;
-					while(i!=list.size())
+					if (node->TreeDepth()==1)
 					{
-						if (list[i]->IsUnique() && list[i]->TreeDepth()>1)
+						const size_t n = std::min(len, node->Length()-pos);
+						if (!fn(node, pos, n))
+							return false;
+						len -= n;
+						pos = 0;
+						if (len)
+							node = stack.Pop();
+					}
+					else
+					{
+						std::pair< RopeRep*, RopeRep* > p = node->ChildPtrs();
+						const size_t ll = p.first->Length();
+						if (pos>=ll)
 						{
-							std::pair< Ptr, Ptr > p = list[i]->GetChildren();
-							list.push_back(p.first);
-							list[i] = p.second;
+							pos -= ll;
+							node = p.second;
 						}
-						else
+						else 
 						{
-							list[i++] = 0;
+							if (pos+len>ll)
+								stack.Push( p.second );
+							node = p.first;
 						}
 					}
 				}
+				return true;
 			}
 
-			// this code flattens the callstack by "unwinding" the traversal of the tree
-			// prevents a stack overflow if you concatinate, ie 1000000 strings
-			virtual CharSet Get(size_t offset) const {
-				std::pair< Ptr, Ptr > p(mLhs, mRhs);
-				CharSet result = 0;
-				while(!result)
+			// as per ForEachLeaf, but visits the leaves last to first
+			template< typename Fn >
+			bool ForEachLeafReverse(size_t pos, size_t len, Fn fn) const
+			{
+				assert(pos+len<=Length());
+				NodeStack stack;
+
+				// range still to visit is [end-len, end), relative to node
+				const RopeRep* node = this;
+				size_t end = pos+len;
+				while(len)
 				{
-					size_t ll = p.first->Length();
-					if (offset<ll) 
+					if (node->TreeDepth()==1)
 					{
-						if (p.first->TreeDepth()==1)
+						const size_t n = std::min(len, end);
+						if (!fn(node, end-n, n))
+							return false;
+						len -= n;
+						if (len)
 						{
-							result = p.first->Get(offset);
-						}
-						else
-						{
-							p = p.first->GetChildren();
+							node = stack.Pop();
+							end = node->Length();
 						}
 					}
 					else
 					{
-						offset -= ll;
-						if (p.second->TreeDepth()==1)
+						std::pair< RopeRep*, RopeRep* > p = node->ChildPtrs();
+						const size_t ll = p.first->Length();
+						if (end<=ll)
 						{
-							result = p.second->Get(offset);
+							node = p.first;
 						}
-						else
+						else 
 						{
-							p = p.second->GetChildren();
+							// the range may start left of this node, so compare lengths rather than positions
+							if (len>end-ll)
+								stack.Push( p.first );
+							end -= ll;
+							node = p.second;
 						}
 					}
 				}
-
-				return result;
+				return true;
 			}
 
-			virtual size_t Length() const {
-				return mLength;
+			// calls fn(data, length) for each contiguous span of [pos, pos+len), in order.
+			// Stops (and returns false) as soon as fn returns false.
+			template< typename Fn >
+			bool ForEachChunk(size_t pos, size_t len, Fn fn) const
+			{
+				CharT buffer[SPAN_BUFFER_SIZE];
+				return ForEachLeaf(pos, len, [&](const RopeRep* leaf, size_t leafPos, size_t leafLen) -> bool {
+					while(leafLen)
+					{
+						size_t n = leafLen;
+						const CharT* data = leaf->GetSpan(leafPos, n, buffer, SPAN_BUFFER_SIZE);
+						if (!fn(data, n))
+							return false;
+						leafPos += n;
+						leafLen -= n;
+					}
+					return true;
+				});
 			}
 
-			virtual size_t TreeDepth()const {
-				return mDepth;
+			// as per ForEachChunk, but visits the spans last to first
+			template< typename Fn >
+			bool ForEachChunkReverse(size_t pos, size_t len, Fn fn) const
+			{
+				CharT buffer[SPAN_BUFFER_SIZE];
+				return ForEachLeafReverse(pos, len, [&](const RopeRep* leaf, size_t leafPos, size_t leafLen) -> bool {
+					size_t n = leafLen;
+					const CharT* data = leaf->GetSpan(leafPos, n, 0, 0);
+					if (n==leafLen)
+						return fn(data, n);
+
+					// no contiguous storage, copy out spans from the end of the leaf backward
+					size_t leafEnd = leafPos+leafLen;
+					while(leafEnd!=leafPos)
+					{
+						const size_t m = std::min<size_t>(leafEnd-leafPos, SPAN_BUFFER_SIZE);
+						leaf->Copy(leafEnd-m, m, buffer);
+						if (!fn(buffer, m))
+							return false;
+						leafEnd -= m;
+					}
+					return true;
+				});
 			}
 
-			virtual std::pair< Ptr, Ptr > GetChildren()const {
-				return std::pair< Ptr, Ptr >(mLhs, mRhs);
+			// the shortest string a balanced tree of the given depth may hold
+			// (Fibonacci bound, as per Boehm, Atkinson & Plass "Ropes: an Alternative to Strings")
+			static size_t MinBalancedLength(size_t depth)
+			{
+				static const MinLengthTable table;
+				return depth < MinLengthTable::Size ? table.mLength[depth] : size_t(-1);
 			}
 
-			virtual StringType GetString() const {
-				return mLhs->GetString() + mRhs->GetString();
-			}		
+			// leaves are always balanced, trees are if they hold enough characters for their depth
+			bool IsBalanced() const {
+				return TreeDepth()==1 || Length() >= MinBalancedLength(TreeDepth());
+			}
 
 		private:
-			const size_t mLength;
-			const size_t mDepth;
-			Ptr mLhs, mRhs;
+			// the nodes still to visit on a walk of the tree, held inline unless the tree is 
+			// unusually deep, so short walks (a search of a small rope, say) don't allocate
+			class NodeStack
+			{
+				public:
+					NodeStack()
+						: mSize(0)
+					{
+					}
+
+					void Push(const RopeRep* node)
+					{
+						if (mSize<InlineSize)
+							mInline[mSize] = node;
+						else
+							mOverflow.push_back(node);
+						++mSize;
+					}
+
+					const RopeRep* Pop()
+					{
+						assert(mSize>0);
+						--mSize;
+						if (mSize<InlineSize)
+							return mInline[mSize];
+						const RopeRep* node = mOverflow.back();
+						mOverflow.pop_back();
+						return node;
+					}
+
+				private:
+					enum { InlineSize = 48 };
+
+					const RopeRep* mInline[InlineSize];
+					std::vector< const RopeRep* > mOverflow;
+					size_t mSize;
+			};
+
+			struct MinLengthTable
+			{
+				enum { Size = 96 };
+
+				// depth 1 => 1, depth 2 => 2, depth 3 => 3, depth 4 => 5 ... saturating at size_t(-1)
+				MinLengthTable()
+				{
+					mLength[0] = 0;
+					mLength[1] = 1;
+					mLength[2] = 2;
+					for(size_t i=3;i!=Size;++i)
+					{
+						mLength[i] = (mLength[i-1] > size_t(-1) - mLength[i-2]) ? 
+							size_t(-1) : mLength[i-1] + mLength[i-2];
+					}
+				}
+
+				size_t mLength[Size];
+			};
+	};
+
+	// found by RefCountedObjPtr (via argument dependent lookup).
+	// Deep trees go to the thread's Reclaimer, if it has one, nodes whose counts aren't 
+	// thread safe may only be released on this thread
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	inline void DestroyRefCounted(RopeRep<CharT, SynchronizationPrimative, Allocator>* rep)
+	{
+		typedef RopeRep<CharT, SynchronizationPrimative, Allocator> Rep;
+		const bool threadSafe = !std::is_same<SynchronizationPrimative, Synchronization::NullMutex>::value;
+		if (rep->Type()==Rep::ConCatNode && rep->TreeDepth()>=DEFERRED_RECLAIM_DEPTH &&
+			Reclamation::Reclaimer::Defer(rep, &Rep::DestroyErased, threadSafe))
+		{
+			return;
+		}
+		rep->Destroy();
+	}
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	class NullRep : public RopeRep<CharT, SynchronizationPrimative, Allocator>
+	{
+	public:
+		typedef typename RopeRep<CharT, SynchronizationPrimative, Allocator>::Ptr Ptr;
+		typedef typename RopeRep<CharT, SynchronizationPrimative, Allocator>::StringType StringType;
+
+		NullRep()
+			: RopeRep<CharT, SynchronizationPrimative, Allocator>( RopeRep<CharT, SynchronizationPrimative, Allocator>::NullNode, 0, 1 )
+		{
+		}
+
+		virtual CharT Get(size_t offset)const{
+			assert(false); return 0;
+		}
+		// there are no characters, so nothing to copy
+		virtual void Copy(size_t /*pos*/, size_t /*len*/, CharT* /*out*/) const {
+		}
+
+		virtual size_t AllocationSize()const {
+			return sizeof(*this);
+		}
+		
+		// saves having to create one on the heap every time
+		static Ptr Instance();
 	};
+	
+	// feels so wrong
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	typename NullRep<CharT, SynchronizationPrimative, Allocator>::Ptr NullRep<CharT, SynchronizationPrimative, Allocator>::Instance()
+	{
+		static typename RopeRep<CharT, SynchronizationPrimative, Allocator>::Ptr r( 
+			new NullRep<CharT, SynchronizationPrimative, Allocator>()
+		);
+		return r;
+	}
 
-	template< typename CharSet, typename SynchronizationPrimative >
-	class RepeatedSequenceRep : public RopeRep< CharSet, SynchronizationPrimative >
+	// a leaf, the characters are stored inline after the node, so a leaf is a single allocation
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class StringRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
 	{
 		public:
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::Ptr Ptr;
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::StringType StringType;
-                        
-			RepeatedSequenceRep(  size_t count, Ptr const & sequence )
-				: mLength(count * sequence->Length())
-				, mSequence(sequence)
+            typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+            typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;
+
+			// a leaf holding a copy of data[0, length)
+			static StringRep* Create( const CharSet* data, size_t length )
 			{
+				StringRep* result = CreateUninitialised(length, length);
+				std::char_traits<CharSet>::copy(result->Data(), data, length);
+				return result;
 			}
 
-			virtual CharSet Get(size_t offset) const {
-				return mSequence->Get(offset % mSequence->Length());
+			static StringRep* Create( StringType const & str )
+			{
+				return Create(str.data(), str.size());
 			}
 
-			virtual size_t Length() const {
-				return mLength;
+			// a leaf of length characters, with room for capacity, for the caller to fill in via Data()
+			static StringRep* CreateUninitialised( size_t length, size_t capacity )
+			{
+				assert(length<=capacity);
+				void* memory = Allocator::Allocate( sizeof(StringRep) + capacity*sizeof(CharSet) );
+				return new (memory) StringRep(length, capacity);
 			}
 
-			virtual size_t TreeDepth()const {
-				return 1;
+			CharSet* Data() {
+				return reinterpret_cast<CharSet*>(this+1);
 			}
 
-			virtual StringType GetString() const {
-				StringType result, part(mSequence->GetString());
-				result.reserve(Length());
-				while(result.size()!=mLength)
-					result+=part;
-
-				return result;
+			const CharSet* Data() const {
+				return reinterpret_cast<const CharSet*>(this+1);
 			}
 
-		private:
-			const size_t mLength;
-			const Ptr mSequence;
-	};
+			size_t Capacity() const {
+				return mCapacity;
+			}
 
-	template< typename CharSet, typename SynchronizationPrimative >
-	class SubStrRep : public RopeRep< CharSet, SynchronizationPrimative >
-	{
-		public:
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::Ptr Ptr;
-			typedef typename RopeRep<CharSet, SynchronizationPrimative>::StringType StringType;
-                        
-			// half open range [start, end)
-			SubStrRep(  size_t start, size_t end, Ptr const & str )
-				: mStart(start)
-				, mEnd(end)
-				, mSequence(str)
-			{
+			// lengthens the leaf by n characters, already written to Data()+Length() by the caller.
+			// Only for a leaf that nothing else can see the characters of yet
+			void Extend(size_t n) {
+				assert(this->Length()+n<=mCapacity);
+				this->AddLength(n);
 			}
 
 			virtual CharSet Get(size_t offset) const {
-				const size_t index = (mStart>mEnd) ? mStart-(offset+1) : mStart+offset;
-				return mSequence->Get(index);
+				assert(offset<this->Length());
+				return Data()[offset];
 			}
 
-			virtual size_t Length() const {
-				return (mEnd>=mStart) ? mEnd-mStart : mStart-mEnd;
+			virtual void Copy(size_t pos, size_t len, CharSet* out) const {
+				assert(pos+len<=this->Length());
+				std::char_traits<CharSet>::copy(out, Data()+pos, len);
 			}
 
-			virtual size_t TreeDepth()const {
-				//return mDepth;
-				return 1;
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet*, size_t) const {
+				assert(pos<=this->Length());
+				len = std::min(len, this->Length()-pos);
+				return Data()+pos;
 			}
 
 			virtual StringType GetString() const {
-				StringType result;
-				result.reserve(Length());
-				for(size_t i=0;i!=Length();++i)
-					result+=Get(i);
+				return StringType(Data(), this->Length());
+			}
 
-				return result;
+			virtual size_t AllocationSize()const {
+				return sizeof(StringRep) + mCapacity*sizeof(CharSet);
 			}
 
 		private:
-			const size_t mStart;
-			const size_t mEnd;
-			const Ptr mSequence;
+			StringRep( size_t length, size_t capacity )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringNode, length, 1 )
+				, mCapacity(capacity)
+			{
+			}
+
+			const size_t mCapacity;
 	};
 
-	template< typename CharT, typename SynchronizationPrimative	>
-	class Rope
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class ConCatRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
 	{
 		public:
-			typedef typename RopeRep<CharT, SynchronizationPrimative>::StringType StringType;
-			typedef typename RopeRep<CharT, SynchronizationPrimative>::Ptr Ptr;
-			typedef NullRep<CharT, SynchronizationPrimative> NullRep;
-            typedef CharT value_type;
-			typedef const CharT* pointer;
-			typedef const CharT& const_reference;
-			typedef size_t size_type;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;			
+                        
+			ConCatRep(  Ptr const & lhs, Ptr const & rhs )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( 
+					RopeRep<CharSet, SynchronizationPrimative, Allocator>::ConCatNode,
+					lhs->Length() + rhs->Length(), 
+					std::max(lhs->TreeDepth(), rhs->TreeDepth())+1 
+				)
+				, mLhs(lhs)
+				, mRhs(rhs)
+			{
+			}
 
-			
+			~ConCatRep()
+			{
+				Dismantle(mLhs);
+				Dismantle(mRhs);
+			}
+
+			// this code flattens the callstack by "unwinding" the traversal of the tree
+			// prevents a stack overflow if you concatinate, ie 1000000 strings
+			// (borrowed pointers, the tree is kept alive by this node for the duration)
+			virtual CharSet Get(size_t offset) const {
+				assert(offset<this->Length());
+				const RopeRep<CharSet, SynchronizationPrimative, Allocator>* node = this;
+				while(node->TreeDepth()!=1)
+				{
+					std::pair< RopeRep<CharSet, SynchronizationPrimative, Allocator>*, RopeRep<CharSet, SynchronizationPrimative, Allocator>* > p = 
+						node->ChildPtrs();
+					const size_t ll = p.first->Length();
+					if (offset<ll) 
+					{
+						node = p.first;
+					}
+					else
+					{
+						offset -= ll;
+						node = p.second;
+					}
+				}
+
+				return node->At(offset);
+			}
+
+			virtual std::pair< Ptr, Ptr > GetChildren()const {
+				return std::pair< Ptr, Ptr >(mLhs, mRhs);
+			}
+
+			virtual std::pair< RopeRep<CharSet, SynchronizationPrimative, Allocator>*, RopeRep<CharSet, SynchronizationPrimative, Allocator>* > GetChildPtrs()const {
+				return std::make_pair( mLhs.GetPtr(), mRhs.GetPtr() );
+			}
+
+			// for appending in place, swaps in a (same depth) replacement for the right hand child.
+			// Only for a node that nothing else refers to (see Rope::append)
+			void ReplaceRhs(Ptr const & rhs) {
+				assert(rhs->TreeDepth()<this->TreeDepth());
+				mRhs = rhs;
+			}
+
+			virtual size_t AllocationSize()const {
+				return sizeof(*this);
+			}
+
+		protected:
+			// combined from the children's hashes, unhashed concatenations below are 
+			// hashed bottom up first, so the callstack doesn't grow with the tree depth
+			virtual uint64_t ComputeHash()const {
+				typedef RopeRep<CharSet, SynchronizationPrimative, Allocator> Rep;
+				std::vector< const Rep* > stack;
+				stack.push_back( mRhs.GetPtr() );
+				stack.push_back( mLhs.GetPtr() );
+				while(!stack.empty())
+				{
+					const Rep* node = stack.back();
+					uint64_t hash;
+					if (node->Type()!=Rep::ConCatNode || node->CachedHash(hash))
+					{
+						stack.pop_back();
+						continue;
+					}
+
+					std::pair< Rep*, Rep* > p = node->ChildPtrs();
+					bool ready = true;
+					if (p.second->Type()==Rep::ConCatNode && !p.second->CachedHash(hash))
+					{
+						stack.push_back( p.second );
+						ready = false;
+					}
+					if (p.first->Type()==Rep::ConCatNode && !p.first->CachedHash(hash))
+					{
+						stack.push_back( p.first );
+						ready = false;
+					}
+					if (ready)
+					{
+						node->Hash();
+						stack.pop_back();
+					}
+				}
+				return PolynomialHash::Combine( mLhs->Hash(), mRhs->Hash(), mRhs->Length() );
+			}
+
+		public:
+			// visits each leaf in the range once, again with a flattened callstack
+			virtual void Copy(size_t pos, size_t len, CharSet* out) const {
+				this->ForEachLeaf(pos, len, [&out](const RopeRep<CharSet, SynchronizationPrimative, Allocator>* leaf, size_t leafPos, size_t leafLen) -> bool {
+					leaf->Copy(leafPos, leafLen, out);
+					out += leafLen;
+					return true;
+				});
+			}
+
+			// descends to the leaf holding pos, so the span ends at most at the end of that leaf
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet* buffer, size_t bufferSize) const {
+				assert(pos<this->Length());
+				const CharSet* result = 0;
+				this->ForEachLeaf(pos, 1, [&](const RopeRep<CharSet, SynchronizationPrimative, Allocator>* leaf, size_t leafPos, size_t) -> bool {
+					len = std::min(len, leaf->Length()-leafPos);
+					result = leaf->GetSpan(leafPos, len, buffer, bufferSize);
+					return false;
+				});
+				return result;
+			}
+
+			// rebuilds the tree so that its depth is within the Fibonacci bound
+			// sub trees that are already balanced are reused as they are, so re-balancing a 
+			// balanced tree that has since been appended to only rebuilds the new fragments
+			// (Boehm's algorithm, see "Ropes: an Alternative to Strings")
+			static Ptr Balance(Ptr const & root)
+			{
+				if (root->IsBalanced())
+					return root;
+
+				Ptr forest[ForestSize];
+
+				// in-order walk of the unbalanced part of the tree, again flattening 
+				// the callstack so that degenerate trees don't overflow the stack
+				std::vector< RopeRep<CharSet, SynchronizationPrimative, Allocator>* > stack;
+				stack.reserve( root->TreeDepth() );
+				stack.push_back( root.GetPtr() );
+				while(!stack.empty())
+				{
+					RopeRep<CharSet, SynchronizationPrimative, Allocator>* node = stack.back();
+					stack.pop_back();
+					if (node->IsBalanced())
+					{
+						AddToForest( Ptr(node), forest );
+					}
+					else
+					{
+						std::pair< RopeRep<CharSet, SynchronizationPrimative, Allocator>*, RopeRep<CharSet, SynchronizationPrimative, Allocator>* > p = 
+							node->ChildPtrs();
+						stack.push_back( p.second );
+						stack.push_back( p.first );
+					}
+				}
+
+				Ptr result;
+				for(size_t i=0;i!=ForestSize;++i)
+				{
+					if (forest[i])
+						result = Concat( forest[i], result );
+				}
+				return result;
+			}
+
+		private:
+			enum { ForestSize = 96 };
+
+			// releases tree, which may hold the last reference to a deep one.
+			// Uniquely owned concatenations are rotated right until their left child can be dropped,
+			// then freed one at a time down the right spine, so the teardown neither recurses
+			// nor allocates, however deep the tree.  Shared subtrees are just released
+			static void Dismantle( Ptr& tree )
+			{
+				typedef RopeRep<CharSet, SynchronizationPrimative, Allocator> Rep;
+				Ptr root = std::move(tree);
+				while(root && root->Type()==Rep::ConCatNode && root->IsUnique())
+				{
+					ConCatRep* node = static_cast<ConCatRep*>(root.GetPtr());
+					if (node->mLhs->Type()==Rep::ConCatNode && node->mLhs->IsUnique())
+					{
+						Ptr lhs = std::move(node->mLhs);
+						ConCatRep* rotated = static_cast<ConCatRep*>(lhs.GetPtr());
+						node->mLhs = std::move(rotated->mRhs);
+						rotated->mRhs = std::move(root);
+						root = std::move(lhs);
+					}
+					else
+					{
+						node->mLhs = Ptr();
+						Ptr rhs = std::move(node->mRhs);
+
+						// childless, so freed directly rather than through the thread's Reclaimer
+						root.Detach();
+						node->DecRef();
+						node->Destroy();
+						root = std::move(rhs);
+					}
+				}
+			}
+
+			// concatenation of two (possibly null) trees
+			static Ptr Concat( Ptr const & lhs, Ptr const & rhs )
+			{
+				if (!lhs) return rhs;
+				if (!rhs) return lhs;
+				return Ptr( new ConCatRep( lhs, rhs ) );
+			}
+
+			// forest[i] holds a tree of length [MinBalancedLength(i+1), MinBalancedLength(i+2)), 
+			// trees are added in order, so everything already in the forest is to the left of 'node'
+			static void AddToForest( Ptr const & node, Ptr* forest )
+			{
+				typedef RopeRep<CharSet, SynchronizationPrimative, Allocator> Rep;
+				const size_t length = node->Length();
+
+				// gather up everything too short to sit beneath node
+				Ptr tooTiny;
+				size_t i = 0;
+				for(; i+1!=ForestSize && length >= Rep::MinBalancedLength(i+2); ++i)
+				{
+					if (forest[i])
+					{
+						tooTiny = Concat( forest[i], tooTiny );
+						forest[i] = 0;
+					}
+				}
+
+				Ptr insertee = Concat( tooTiny, node );
+				for(;; ++i)
+				{
+					if (forest[i])
+					{
+						insertee = Concat( forest[i], insertee );
+						forest[i] = 0;
+					}
+					if (i+1==ForestSize || insertee->Length() < Rep::MinBalancedLength(i+2))
+					{
+						forest[i] = insertee;
+						break;
+					}
+				}
+			}
+
+			Ptr mLhs, mRhs;
+	};
+
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class RepeatedSequenceRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
+	{
+		public:
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;
+                        
+			RepeatedSequenceRep(  size_t count, Ptr const & sequence )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( 
+					RopeRep<CharSet, SynchronizationPrimative, Allocator>::RepeatedSequenceNode, count * sequence->Length(), 1 
+				)
+				, mPeriod(sequence->Length())
+				, mSequence(sequence)
+			{
+			}
+
+			virtual CharSet Get(size_t offset) const {
+				return mSequence->At(offset % mPeriod);
+			}
+
+			// spans come straight from the repeated sequence, so end at the end of each repetition
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet* buffer, size_t bufferSize) const {
+				assert(pos<this->Length());
+				const size_t offset = pos % mPeriod;
+				len = std::min(len, mPeriod-offset);
+				return mSequence->GetSpan(offset, len, buffer, bufferSize);
+			}
+
+			// copies one period from the sequence, then doubles what has been written 
+			// (which is a whole number of periods, so repeats) until len is reached
+			virtual void Copy(size_t pos, size_t len, CharSet* out) const {
+				assert(pos+len<=this->Length());
+				const size_t offset = pos % mPeriod;
+				const size_t head = std::min(len, mPeriod-offset);
+				mSequence->Copy(offset, head, out);
+				if (len>head)
+				{
+					const size_t tail = std::min(len-head, offset);
+					mSequence->Copy(0, tail, out+head);
+				}
+
+				size_t written = std::min(len, mPeriod);
+				while(written!=len)
+				{
+					const size_t n = std::min(written, len-written);
+					std::char_traits<CharSet>::copy(out+written, out, n);
+					written += n;
+				}
+			}
+
+			virtual size_t AllocationSize()const {
+				return sizeof(*this);
+			}
+
+			Ptr const & Sequence()const {
+				return mSequence;
+			}
+
+		protected:
+			virtual uint64_t ComputeHash()const {
+				return mPeriod ? PolynomialHash::Repeat( mSequence->Hash(), mPeriod, this->Length()/mPeriod ) : 0;
+			}
+
+		private:
+			const size_t mPeriod;
+			const Ptr mSequence;
+	};
+
+	// a run of a single character.  The first few characters are stored inline, 
+	// so the run can be handed out as contiguous spans without being expanded
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class FillRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
+	{
+		public:
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;
+
+			static FillRep* Create( size_t count, CharSet c )
+			{
+				const size_t spanLength = std::min<size_t>(count, SPAN_BUFFER_SIZE);
+				void* memory = Allocator::Allocate( sizeof(FillRep) + spanLength*sizeof(CharSet) );
+				return new (memory) FillRep(count, c, spanLength);
+			}
+
+			CharSet Char() const {
+				return mChar;
+			}
+
+			// every character is the same, so the position doesn't matter
+			virtual CharSet Get(size_t /*offset*/) const {
+				return mChar;
+			}
+
+			virtual void Copy(size_t /*pos*/, size_t len, CharSet* out) const {
+				std::char_traits<CharSet>::assign(out, len, mChar);
+			}
+
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet*, size_t) const {
+				assert(pos<this->Length());
+				len = std::min( len, std::min(mSpanLength, this->Length()-pos) );
+				return Data();
+			}
+
+			virtual StringType GetString() const {
+				return StringType(this->Length(), mChar);
+			}
+
+			virtual size_t AllocationSize()const {
+				return sizeof(FillRep) + mSpanLength*sizeof(CharSet);
+			}
+
+		protected:
+			virtual uint64_t ComputeHash()const {
+				return PolynomialHash::Repeat( PolynomialHash::Append(0, &mChar, 1), 1, this->Length() );
+			}
+
+		private:
+			FillRep( size_t count, CharSet c, size_t spanLength )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( RopeRep<CharSet, SynchronizationPrimative, Allocator>::FillNode, count, 1 )
+				, mSpanLength(spanLength)
+				, mChar(c)
+			{
+				std::char_traits<CharSet>::assign(Data(), spanLength, c);
+			}
+
+			CharSet* Data() {
+				return reinterpret_cast<CharSet*>(this+1);
+			}
+
+			const CharSet* Data() const {
+				return reinterpret_cast<const CharSet*>(this+1);
+			}
+
+			const size_t mSpanLength;
+			const CharSet mChar;
+	};
+
+	// a leaf referring straight into a memory mapped file, which it keeps mapped
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class MappedRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
+	{
+		public:
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;
+
+			// the length characters at data, which must be within file
+			MappedRep( MappedFile::Ptr const & file, const CharSet* data, size_t length )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( RopeRep<CharSet, SynchronizationPrimative, Allocator>::MappedNode, length, 1 )
+				, mFile(file)
+				, mData(data)
+			{
+				assert( reinterpret_cast<const char*>(data+length) <= file->Data()+file->Size() );
+			}
+
+			const MappedFile::Ptr& File() const {
+				return mFile;
+			}
+
+			const CharSet* Data() const {
+				return mData;
+			}
+
+			virtual CharSet Get(size_t offset) const {
+				assert(offset<this->Length());
+				return mData[offset];
+			}
+
+			virtual void Copy(size_t pos, size_t len, CharSet* out) const {
+				assert(pos+len<=this->Length());
+				std::char_traits<CharSet>::copy(out, mData+pos, len);
+			}
+
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet*, size_t) const {
+				assert(pos<=this->Length());
+				len = std::min(len, this->Length()-pos);
+				return mData+pos;
+			}
+
+			virtual StringType GetString() const {
+				return StringType(mData, this->Length());
+			}
+
+			virtual size_t AllocationSize()const {
+				return sizeof(*this);
+			}
+
+		private:
+			const MappedFile::Ptr mFile;
+			const CharSet* const mData;
+	};
+
+	template< typename CharSet, typename SynchronizationPrimative, typename Allocator >
+	class SubStrRep : public RopeRep< CharSet, SynchronizationPrimative, Allocator >
+	{
+		public:
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef typename RopeRep<CharSet, SynchronizationPrimative, Allocator>::StringType StringType;
+                        
+			// half open range [start, end)
+			SubStrRep(  size_t start, size_t end, Ptr const & str )
+				: RopeRep<CharSet, SynchronizationPrimative, Allocator>( 
+					RopeRep<CharSet, SynchronizationPrimative, Allocator>::SubStrNode, (end>=start) ? end-start : start-end, 1 
+				)
+				, mStart(start)
+				, mEnd(end)
+				, mSequence(str)
+			{
+			}
+
+			virtual CharSet Get(size_t offset) const {
+				const size_t index = (mStart>mEnd) ? mStart-(offset+1) : mStart+offset;
+				return mSequence->At(index);
+			}
+
+			virtual void Copy(size_t pos, size_t len, CharSet* out) const {
+				assert(pos+len<=this->Length());
+				if (mStart>mEnd)
+				{
+					// reversed, copy the mirrored range then reverse it in place
+					mSequence->Copy(mStart-(pos+len), len, out);
+					std::reverse(out, out+len);
+				}
+				else
+				{
+					mSequence->Copy(mStart+pos, len, out);
+				}
+			}
+
+			virtual const CharSet* GetSpan(size_t pos, size_t& len, CharSet* buffer, size_t bufferSize) const {
+				assert(pos<this->Length());
+				len = std::min(len, this->Length()-pos);
+				if (mStart>mEnd)
+				{
+					return RopeRep<CharSet, SynchronizationPrimative, Allocator>::GetSpan(pos, len, buffer, bufferSize);
+				}
+				return mSequence->GetSpan(mStart+pos, len, buffer, bufferSize);
+			}
+
+			virtual size_t AllocationSize()const {
+				return sizeof(*this);
+			}
+
+			bool IsReversed()const {
+				return mStart>mEnd;
+			}
+
+			size_t Start()const {
+				return mStart;
+			}
+
+			size_t End()const {
+				return mEnd;
+			}
+
+			Ptr const & Sequence()const {
+				return mSequence;
+			}
+
+		private:
+			const size_t mStart;
+			const size_t mEnd;
+			const Ptr mSequence;
+	};
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	inline CharT RopeRep<CharT, SynchronizationPrimative, Allocator>::At(size_t offset)const
+	{
+#ifdef ROPE_TAGGED_DISPATCH
+		switch(mType)
+		{
+			case StringNode:
+				return static_cast< const StringRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					StringRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			case ConCatNode:
+				return static_cast< const ConCatRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					ConCatRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			case RepeatedSequenceNode:
+				return static_cast< const RepeatedSequenceRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					RepeatedSequenceRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			case SubStrNode:
+				return static_cast< const SubStrRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					SubStrRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			case FillNode:
+				return static_cast< const FillRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					FillRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			case MappedNode:
+				return static_cast< const MappedRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+					MappedRep<CharT, SynchronizationPrimative, Allocator>::Get(offset);
+			default:
+				break;
+		}
+#endif
+		return Get(offset);
+	}
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	inline std::pair< RopeRep<CharT, SynchronizationPrimative, Allocator>*, RopeRep<CharT, SynchronizationPrimative, Allocator>* > 
+		RopeRep<CharT, SynchronizationPrimative, Allocator>::ChildPtrs()const
+	{
+#ifdef ROPE_TAGGED_DISPATCH
+		if (mType==ConCatNode)
+		{
+			return static_cast< const ConCatRep<CharT, SynchronizationPrimative, Allocator>* >(this)->
+				ConCatRep<CharT, SynchronizationPrimative, Allocator>::GetChildPtrs();
+		}
+#endif
+		return GetChildPtrs();
+	}
+
+	// substring search within a contiguous range, either forward (first match) or backward (last match).
+	// Candidates are found by scanning for the needle's rarest character (going by a rough 
+	// table of letter frequencies) with char_traits::find, memchr for char, then checked with compare.
+	// Also holds the buffer matches straddling two spans are searched for in, see Rope::ForEachMatch
+	template< typename CharT >
+	class SubstringSearcher
+	{
+		public:
+			SubstringSearcher( const CharT* needle, size_t length )
+				: mNeedle(needle)
+				, mLength(length)
+				, mAnchor(RarestIndex(needle, length))
+				, mAnchorChar(needle[mAnchor])
+			{
+				assert(length>0);
+				if (BridgeSize()>InlineBridgeSize)
+					mOverflow.resize( BridgeSize() );
+			}
+
+			size_t Length() const {
+				return mLength;
+			}
+
+			// index of the first match in data[0, n), or n if there isn't one
+			size_t Find(const CharT* data, size_t n) const
+			{
+				if (n<mLength)
+					return n;
+
+				// candidate positions of the anchor character are [mAnchor, last]
+				const size_t last = n-mLength+mAnchor;
+				for(size_t i=mAnchor;i<=last;)
+				{
+					const CharT* found = std::char_traits<CharT>::find(data+i, last-i+1, mAnchorChar);
+					if (!found)
+						break;
+					const size_t start = (found-data)-mAnchor;
+					if (std::char_traits<CharT>::compare(data+start, mNeedle, mLength)==0)
+						return start;
+					i = (found-data)+1;
+				}
+				return n;
+			}
+
+			// index of the last match in data[0, n), or n if there isn't one
+			size_t FindLast(const CharT* data, size_t n) const
+			{
+				if (n<mLength)
+					return n;
+
+				for(size_t i=n-mLength+mAnchor+1;i!=mAnchor;)
+				{
+					--i;
+					if (data[i]==mAnchorChar && std::char_traits<CharT>::compare(data+i-mAnchor, mNeedle, mLength)==0)
+						return i-mAnchor;
+				}
+				return n;
+			}
+
+			// room for the length-1 characters either side of a span boundary
+			CharT* Bridge() {
+				return (BridgeSize()>InlineBridgeSize) ? &mOverflow[0] : mInlineBridge;
+			}
+
+		private:
+			enum { InlineBridgeSize = 64 };
+
+			size_t BridgeSize() const {
+				return 2*(mLength-1);
+			}
+
+			// the index of the needle character least likely to occur in text, the first of equals
+			static size_t RarestIndex(const CharT* needle, size_t length)
+			{
+				size_t result = 0;
+				size_t best = size_t(-1);
+				for(size_t i=0;i!=length && best!=0;++i)
+				{
+					const size_t frequency = Frequency(needle[i]);
+					if (frequency<best)
+					{
+						best = frequency;
+						result = i;
+					}
+				}
+				return result;
+			}
+
+			// higher for commoner characters, 0 for anything but a space or lower case letter
+			static size_t Frequency(CharT c)
+			{
+				static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+				const size_t n = sizeof(common)-1;
+				for(size_t i=0;i!=n;++i)
+				{
+					if (c==CharT(common[i]))
+						return n-i;
+				}
+				return 0;
+			}
+
+			const CharT* mNeedle;
+			const size_t mLength;
+			const size_t mAnchor;
+			const CharT mAnchorChar;
+			CharT mInlineBridge[InlineBridgeSize];
+			std::vector< CharT > mOverflow;
+	};
+
+	// the shape of a rope's tree and the memory it holds, see Rope::stats.
+	// Nodes reachable by more than one path (shared subtrees) are counted once
+	struct RopeStats
+	{
+		// one per RopeRep::NodeType
+		enum { NodeTypes = 7 };
+
+		RopeStats()
+			: mLength(0)
+			, mDepth(0)
+			, mInline(false)
+			, mBalanced(true)
+			, mNodes(0)
+			, mSharedNodes(0)
+			, mLeaves(0)
+			, mBytesReachable(0)
+			, mBytesOwned(0)
+			, mBytesHidden(0)
+			, mBytesSpare(0)
+		{
+			std::fill(mNodesOfType, mNodesOfType+NodeTypes, size_t(0));
+		}
+
+		static const char* TypeName(size_t type)
+		{
+			static const char* const names[NodeTypes] = { "null", "string", "concat", "repeat", "substr", "fill", "mapped" };
+			return type<NodeTypes ? names[type] : "unknown";
+		}
+
+		// of the bytes reachable, the share that is characters hidden by substr and reverse 
+		// wrappers, or unused leaf capacity, which a flat copy of the rope wouldn't hold
+		double WastedShare() const {
+			return mBytesReachable ? double(mBytesHidden+mBytesSpare)/mBytesReachable : 0;
+		}
+
+		size_t mLength;
+		size_t mDepth;
+		bool mInline;		// held in the handle, there are no nodes
+		bool mBalanced;		// within the Fibonacci bound, see RopeRep::IsBalanced
+
+		size_t mNodes;
+		size_t mNodesOfType[NodeTypes];
+		size_t mSharedNodes;	// nodes with a reference count above one
+
+		// leaves of the tree itself, the sequences substr and repeat nodes refer to 
+		// are counted as nodes, but not as leaves.
+		// mLeafDepths[d] leaves are d levels below the root, 
+		// mLeafSizes[i] leaves have fewer than 2^i characters (and at least 2^(i-1))
+		size_t mLeaves;
+		std::vector< size_t > mLeafDepths;
+		std::vector< size_t > mLeafSizes;
+
+		size_t mBytesReachable;	// allocated for every node reachable from the rope
+		size_t mBytesOwned;		// of those, the bytes the rope alone refers to, freed along with it
+		size_t mBytesHidden;	// characters kept alive by substr and reverse wrappers, but not part of them
+		size_t mBytesSpare;		// unused capacity of leaves
+	};
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	class RopeBuilder;
+
+	template< typename CharT, typename Allocator >
+	class ConcurrentRope;
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator = Allocation::HeapAllocator >
+	class Rope
+	{
+		public:
+			typedef typename RopeRep<CharT, SynchronizationPrimative, Allocator>::StringType StringType;
+			typedef typename RopeRep<CharT, SynchronizationPrimative, Allocator>::Ptr Ptr;
+			typedef RopeRep<CharT, SynchronizationPrimative, Allocator> Rep;
+			typedef WCRope::NullRep<CharT, SynchronizationPrimative, Allocator> NullRep;
+            typedef CharT value_type;
+			typedef const CharT* pointer;
+			typedef const CharT& const_reference;
+			typedef size_t size_type;
+
+			
 			// note, mutable access to chars is not permitted
 			// but as with iterators, the typedef is defined as per const version
 			typedef const CharT& reference; 
 
-			// constructs a null/empty string
-			Rope( )
-				: mRopeRep( NullRep::Instance() )
+			// constructs a null/empty string
+			Rope( )
+				: mInlineLength(0)
+			{
+				// nothing to do here
+			}
+
+			// constructs a copy of a string 
+			Rope( const StringType& str )
+				: mInlineLength(0)
+			{				
+				Assign( str.data(), str.size() );
+			}
+
+			// constructs a copy of null terminated c-string str
+			Rope( const CharT* str )
+				: mInlineLength(0)
+			{
+				Assign( str, std::char_traits<CharT>::length(str) );
+			}
+
+			// constructs a string of "count" repetitions of rhs
+			Rope( size_t count, const Rope& rhs )
+				: mRopeRep( new RepeatedSequenceRep<CharT, SynchronizationPrimative, Allocator>(count, rhs.Tree()) )
+				, mInlineLength(0)
+			{
+				// nothing to do here
+			}
+
+			// constructs a string of "count" repetitions of char "c"
+			Rope( size_t count, CharT c )
+				: mInlineLength(0)
+			{
+				if (count<=InlineCapacity)
+				{
+					std::char_traits<CharT>::assign( mInline, count, c );
+					mInlineLength = static_cast<unsigned char>(count);
+				}
+				else
+				{
+					mRopeRep = Fill(count, c);
+				}
+			}
+
+			// inline characters are copied, trees are shared.
+			// A moved from string is left empty
+			Rope( const Rope& rhs )
+				: mRopeRep( rhs.mRopeRep )
+				, mInlineLength( rhs.mInlineLength )
+			{
+				CopyInline(rhs);
+			}
+
+			Rope( Rope&& rhs )
+				: mRopeRep( std::move(rhs.mRopeRep) )
+				, mInlineLength( rhs.mInlineLength )
+			{
+				CopyInline(rhs);
+				rhs.mInlineLength = 0;
+			}
+
+			Rope& operator=( const Rope& rhs )
+			{
+				if (this!=&rhs)
+				{
+					mRopeRep = rhs.mRopeRep;
+					mInlineLength = rhs.mInlineLength;
+					CopyInline(rhs);
+				}
+				return *this;
+			}
+
+			Rope& operator=( Rope&& rhs )
+			{
+				if (this!=&rhs)
+				{
+					mRopeRep = std::move(rhs.mRopeRep);
+					mInlineLength = rhs.mInlineLength;
+					CopyInline(rhs);
+					rhs.mInlineLength = 0;
+				}
+				return *this;
+			}
+
+			// the contents of the file at path, memory mapped rather than read.
+			// The mapping is split into a balanced tree of leaves (of MAPPED_LEAF_SIZE characters) 
+			// that refer straight into it, and is released when the last of them is.
+			// Pipes, devices and other files that can't be mapped (or, like those in /proc, 
+			// claim to be empty) are read instead, see read_from.
+			// The file must not be truncated or modified while any leaf of the rope is alive:
+			// touching pages past a truncated end raises SIGBUS, and changes in place show through
+			// into the rope (under the hashes already cached in its nodes). Files that may be 
+			// rotated, appended to or rewritten (logs, say) should be read with read_file instead.
+			// Returns an empty string, and sets *opened to false, if the file can't be opened or read
+			static Rope open_file(const char* path, bool* opened = 0)
+			{
+#ifdef WIN32
+				const MappedFile::Ptr file = MappedFile::Open(path);
+#else
+				const int fd = open( path, O_RDONLY | O_CLOEXEC );
+				if (fd<0)
+				{
+					if (opened)
+						*opened = false;
+					return Rope();
+				}
+
+				const MappedFile::Ptr file = MappedFile::Open(fd);
+				if (!file.GetPtr() || file->Size()==0)
+				{
+					bool ok = true;
+					const Rope read = read_from(fd, &ok);
+					close(fd);
+					if (opened)
+						*opened = ok;
+					return ok ? read : Rope();
+				}
+				close(fd);
+#endif
+				if (opened)
+					*opened = file.GetPtr()!=0;
+
+				Rope result;
+				if (file.GetPtr() && file->Size()>=sizeof(CharT))
+				{
+					const CharT* data = reinterpret_cast<const CharT*>( file->Data() );
+					const size_t length = file->Size()/sizeof(CharT);
+					std::vector< Ptr > leaves;
+					leaves.reserve( length/MAPPED_LEAF_SIZE+1 );
+					for(size_t pos=0;pos<length;pos+=MAPPED_LEAF_SIZE)
+					{
+						leaves.push_back( Ptr( new MappedRep<CharT, SynchronizationPrimative, Allocator>(
+							file, data+pos, std::min<size_t>(MAPPED_LEAF_SIZE, length-pos) 
+						) ) );
+					}
+					result.mRopeRep = BuildBalanced( leaves, 0, leaves.size() );
+				}
+				return result;
+			}
+
+			// the contents of the file at path, read into leaves of the rope's own (see read_from),
+			// so unaffected by whatever happens to the file afterwards.
+			// Returns what could be read, and sets *opened to false, if the file can't be opened or read
+			static Rope read_file(const char* path, bool* opened = 0)
+			{
+				bool ok = true;
+#ifdef WIN32
+				std::basic_ifstream<CharT> is( path, std::ios_base::in | std::ios_base::binary );
+				const Rope result = is ? read_from(is) : Rope();
+				ok = is.is_open() && !is.bad();
+#else
+				Rope result;
+				const int fd = open( path, O_RDONLY | O_CLOEXEC );
+				ok = fd>=0;
+				if (ok)
+				{
+					result = read_from(fd, &ok);
+					close(fd);
+				}
+#endif
+				if (opened)
+					*opened = ok;
+				return result;
+			}
+
+			// the rest of the stream's characters, read a leaf at a time (see RopeBuilder).
+			// An unformatted input function, whitespace isn't skipped. Sets eof once the stream 
+			// is exhausted, and fail if there was nothing to read (as per operator>> of a streambuf)
+			static Rope read_from(std::basic_istream<CharT>& is);
+
+#ifndef WIN32
+			// the rest of fd's contents, read straight into leaves (see RopeBuilder).
+			// Retries interrupted reads, and sets *ok to false (with errno set) on an error, 
+			// in which case what was read before the error is returned.
+			// Contents that aren't a whole number of characters are an error too (EILSEQ), 
+			// the trailing part of a character is dropped
+			static Rope read_from(int fd, bool* ok = 0);
+#endif
+
+			// note, special case sub-str constructor for Rope::const_iterator 
+			// can be found after the iterator class
+			template< typename Itr >
+			Rope( Itr ibegin, Itr iend )
+				: mInlineLength(0)
+			{
+				const StringType str(ibegin, iend);
+				Assign( str.data(), str.size() );
+			}
+
+			// concatination (string)
+			Rope& operator+=(const Rope& rhs)
+			{
+				if (rhs.size()<CHUNK_SIZE)
+				{
+					// short strings are copied on to the end (copied out first, as rhs may be this)
+					CharT buffer[CHUNK_SIZE];
+					const size_t n = rhs.size();
+					rhs.copy(0, n, buffer);
+					return append(buffer, n);
+				}
+				Concat( rhs.Tree() );
+				return *this;
+			}
+
+			// concatination (single character)
+			Rope& operator+=(const CharT rhs)
+			{
+				return append(&rhs, 1);
+			}
+
+			void push_back(const CharT c)
+			{
+				append(&c, 1);
+			}
+
+			// appends a copy of data[0, n).
+			// If this rope is the only owner of its rightmost leaf (and the path down to it), 
+			// the characters are written into that leaf's spare capacity, the leaf's capacity 
+			// doubling (up to BUILDER_LEAF_SIZE) when it runs out, 
+			// so appending a character or short string at a time is amortized constant time
+			Rope& append(const CharT* data, size_t n)
+			{
+				if (!n)
+					return *this;
+				if (!mRopeRep)
+				{
+					if (mInlineLength+n<=InlineCapacity)
+					{
+						std::char_traits<CharT>::copy( mInline+mInlineLength, data, n );
+						mInlineLength = static_cast<unsigned char>(mInlineLength+n);
+						return *this;
+					}
+				}
+				else if (AppendInPlace(data, n))
+				{
+					return *this;
+				}
+
+				// a new leaf, with room to append to in place next time.
+				// Short strings (and inline ones, which are outgrowing the handle) are copied into it
+				const size_t length = (size()+n<CHUNK_SIZE || !mRopeRep) ? size()+n : n;
+				StringRep<CharT, SynchronizationPrimative, Allocator>* leaf = 
+					StringRep<CharT, SynchronizationPrimative, Allocator>::CreateUninitialised( length, std::max<size_t>(length, CHUNK_SIZE) );
+				if (length!=n)
+				{
+					copy( 0, size(), leaf->Data() );
+					std::char_traits<CharT>::copy( leaf->Data()+size(), data, n );
+					mRopeRep = leaf;
+				}
+				else
+				{
+					std::char_traits<CharT>::copy( leaf->Data(), data, n );
+					Concat( Ptr(leaf) );
+				}
+				return *this;
+			}
+
+			// rebuilds the tree so that its depth is logarithmic in its length, 
+			// speeding up random access and iterator construction
+			// (done automatically by concatenation when the tree becomes too deep)
+			void balance()
+			{
+				if (mRopeRep)
+					mRopeRep = ConCatRep<CharT, SynchronizationPrimative, Allocator>::Balance( mRopeRep );
+			}
+
+			// an inline string counts as a single leaf
+			size_t TreeDepth() const {
+				return mRopeRep ? mRopeRep->TreeDepth() : 1;
+			}
+
+			size_t size() const {
+				return mRopeRep ? mRopeRep->Length() : mInlineLength;
+			}
+
+			size_t length() const {
+				return size();
+			}
+
+			bool empty() const {
+				return size() == 0;
+			}
+
+			void clear(){
+				mRopeRep = Ptr();
+				mInlineLength = 0;
+			}
+
+			void swap(Rope& rhs) {
+				Rope was( std::move(rhs) );
+				rhs = std::move(*this);
+				*this = std::move(was);
+			}
+
+			CharT front()const {
+				return (*this)[0];
+			}
+
+			CharT back()const {
+				return (*this)[size()-1];
+			}
+
+			CharT operator[](size_t n) const {
+				assert(n<size());
+                return mRopeRep ? mRopeRep->At(n) : mInline[n];
+			}
+
+			// create a substring from start, of size characters in length (clipped to the end of the string).
+			// Shares the subtrees the range covers, and slices the leaves at either end. 
+			// Slices much shorter than their leaf are copied, so a substring keeps at most 
+			// ROPE_SLICE_SHARE_RATIO times its length of the original alive
+			// (and those short enough are held inline)
+			Rope substr(size_t start, size_t size) const
+			{
+				assert(start<=this->size());
+				const size_t length = std::min(size, this->size()-start);
+				Rope result;
+				if (length<=InlineCapacity)
+				{
+					copy( start, length, result.mInline );
+					result.mInlineLength = static_cast<unsigned char>(length);
+				}
+				else
+				{
+					result.mRopeRep = SubRange( mRopeRep, start, start+length );
+				}
+				return result;
+			}
+
+			// splits the string at pos, into [0, pos) and [pos, size()).
+			// Descends the tree to the leaf holding pos, so is O(depth): subtrees either side 
+			// of the path are shared with the result and only the leaf at pos is cut
+			std::pair< Rope, Rope > split(size_t pos) const
+			{
+				assert(pos<=size());
+				std::pair< Rope, Rope > result;
+				if (mRopeRep)
+				{
+					result.first.SetTree( Prefix( mRopeRep, pos ) );
+					result.second.SetTree( Suffix( mRopeRep, pos ) );
+				}
+				else
+				{
+					result.first.Assign( mInline, pos );
+					result.second.Assign( mInline+pos, mInlineLength-pos );
+				}
+				return result;
+			}
+
+			// edits, each is a split and concatenations, so O(depth) and sharing everything 
+			// but the leaves cut at pos (and pos+len)
+			Rope& insert(size_t pos, const Rope& rhs)
+			{
+				return replace(pos, 0, rhs);
+			}
+
+			// len is clipped to the end of the string
+			Rope& erase(size_t pos, size_t len)
+			{
+				return replace(pos, len, Rope());
+			}
+
+			// replaces [pos, pos+len) with rhs, len is clipped to the end of the string
+			Rope& replace(size_t pos, size_t len, const Rope& rhs)
+			{
+				assert(pos<=size());
+				len = std::min(len, size()-pos);
+
+				std::pair< Rope, Rope > head = split(pos);
+				Rope tail = head.second.split(len).second;
+				head.first += rhs;
+				head.first += tail;
+				swap(head.first);
+				return *this;
+			}
+
+			// random access iterator, keeps the path from the root to the current leaf 
+			// so stepping in either direction is (amortized) constant time, 
+			// and seeking to an arbitrary index is O(depth).
+			// The tree is borrowed, not ref counted, so (as per std::string) iterators are 
+			// only valid for as long as the string they came from is alive and unmodified.
+			// Iterators over an inline string point into the handle, so (again as per std::string)
+			// are also invalidated by moving or swapping it
+			class const_iterator 
+			{
+				public:
+	
+					typedef typename std::random_access_iterator_tag iterator_category;
+					typedef CharT value_type;
+					typedef std::ptrdiff_t difference_type;
+					typedef const CharT* pointer;
+					// chars are returned by value (they may not be stored anywhere)
+					typedef CharT reference;
+
+					// null itr - a bit like an end to an empty string
+					const_iterator()
+						: mPosPtr(0)
+						, mRootPtr(0)
+						, mData(0)
+						, mLeafStart(0)
+						, mCharPos(0)
+						, mIndex(0)
+					{
+					}
+
+					// an iterator positioned at index
+					// (index == length of the string for an end())
+					explicit const_iterator(const Rep* root, size_t index)
+						: mPosPtr(0)
+						, mRootPtr(root)
+						, mData(0)
+						, mLeafStart(0)
+						, mCharPos(0)
+						, mIndex(0)
+					{
+						Seek(index);
+					}
+
+					// a normal iterator, starts at the start of the string
+					const_iterator( const Rep* begin )
+						: mPosPtr(0)
+						, mRootPtr(begin)
+						, mData(0)
+						, mLeafStart(0)
+						, mCharPos(0)
+						, mIndex(0)
+					{
+						Seek(0);
+					}
+
+					// an iterator positioned at index of an inline string's characters
+					explicit const_iterator(const CharT* data, size_t index)
+						: mPosPtr(0)
+						, mRootPtr(0)
+						, mData(data)
+						, mLeafStart(0)
+						, mCharPos(index)
+						, mIndex(index)
+					{
+					}
+
+					//dereference operator, get the character at the current location
+					CharT operator*() const {
+						assert(mData || (mPosPtr && mPosPtr->TreeDepth()==1));
+						return mData ? mData[mCharPos] : mPosPtr->At(mCharPos);
+					}
+
+					CharT operator[](difference_type n) const {
+						return *(*this + n);
+					}
+
+					// stride operator, stays within the current leaf where it can, 
+					// otherwise climbs only as far as the common ancestor of the target
+					const_iterator& operator+=(difference_type n) 
+					{
+						Seek(mIndex + n);
+						return *this;
+					}
+
+					const_iterator& operator-=(difference_type n) 
+					{
+						assert( difference_type(mIndex) >= n );
+						Seek(mIndex - n);
+						return *this;
+					}
+
+					const_iterator operator+(difference_type n) const 
+					{
+						const_iterator result(*this);
+						result += n;
+						return result;
+					}
+
+					const_iterator operator-(difference_type n) const 
+					{
+						const_iterator result(*this);
+						result -= n;
+						return result;
+					}
+
+					// pre increment, fast
+					const_iterator& operator++() 
+					{
+						if (mPosPtr && mCharPos+1 < mPosPtr->Length())
+						{
+							++mCharPos;
+							++mIndex;
+						}
+						else
+						{
+							Seek(mIndex+1);
+						}
+						return *this;
+					}
+
+					// post increment, makes a copy of the iterator, expensive on complex strings
+					// to be generally avoided in favor of preincrement
+					const_iterator operator++(int) 
+					{
+						const_iterator was(*this);
+                        ++*this;
+						return was;
+					}
+
+					// pre decrement, as fast as pre increment
+					const_iterator& operator--()
+					{
+						assert( mIndex >= 1 );
+						if (mPosPtr && mCharPos > 0)
+						{
+							--mCharPos;
+							--mIndex;
+						}
+						else
+						{
+							Seek(mIndex-1);
+						}
+						return *this;
+					}
+
+					// post decrement, makes a copy of the iterator, as per post increment
+					const_iterator operator--(int) 
+					{
+						const_iterator was(*this);
+						--*this;
+						return was;
+					}
+
+					// comparison, iterators into the same string are equal if they're at the same index
+					// (end iterators of different but equal sized strings are not)
+					bool operator!=(const const_iterator& rhs) const
+					{
+						return mIndex!=rhs.mIndex || mRootPtr!=rhs.mRootPtr || (!mRootPtr && mData!=rhs.mData);
+					}
+
+					// comparison, as per != 
+					bool operator==(const const_iterator& rhs) const
+					{
+						return !(*this != rhs);
+					}
+
+					bool operator<(const const_iterator& rhs) const {
+						return mIndex < rhs.mIndex;
+					}
+
+					bool operator>(const const_iterator& rhs) const {
+						return mIndex > rhs.mIndex;
+					}
+
+					bool operator<=(const const_iterator& rhs) const {
+						return mIndex <= rhs.mIndex;
+					}
+
+					bool operator>=(const const_iterator& rhs) const {
+						return mIndex >= rhs.mIndex;
+					}
+
+					difference_type distance(const const_iterator& rhs) const {
+						return difference_type(rhs.mIndex) - difference_type(mIndex);
+					}
+
+					difference_type operator-(const const_iterator& rhs) const {
+						return rhs.distance(*this);
+					}
+
+					size_t GetIndex() const {
+						return mIndex;
+					}
+
+					Ptr GetRootPtr() const {
+						return Ptr( const_cast<Rep*>(mRootPtr) );
+					}					
+
+					// the characters of the inline string iterated over, null for a tree
+					const CharT* GetInlineData() const {
+						return mRootPtr ? 0 : mData;
+					}
+
+					void swap(const_iterator &rhs)
+					{
+						std::swap(mPosPtr, rhs.mPosPtr);
+						std::swap(mRootPtr, rhs.mRootPtr);
+						std::swap(mData, rhs.mData);
+						std::swap(mLeafStart, rhs.mLeafStart);
+						std::swap(mCharPos, rhs.mCharPos);
+						std::swap(mIndex, rhs.mIndex);
+						std::swap(mStack, rhs.mStack);
+					}
+
+				private:
+					// moves to index, climbing to the nearest ancestor that holds it
+					// then descending to the leaf that does
+					void Seek(size_t index)
+					{
+						mIndex = index;
+						if (!mRootPtr)
+						{
+							// inline, or a null iterator
+							mCharPos = index;
+							return;
+						}
+						if (mPosPtr && index>=mLeafStart && index-mLeafStart<mPosPtr->Length())
+						{
+							mCharPos = index-mLeafStart;
+							return;
+						}
+
+						mPosPtr = 0;
+						mData = 0;
+						mCharPos = 0;
+						if (!mRootPtr || index>=mRootPtr->Length())
+						{
+							// end (an empty string's begin is its end)
+							mStack.clear();
+							mLeafStart = index;
+							return;
+						}
+
+						while(!mStack.empty() && 
+							(index<mStack.back().second || index-mStack.back().second>=mStack.back().first->Length()))
+						{
+							mStack.pop_back();
+						}
+
+						const Rep* node;
+						size_t start;
+						if (mStack.empty())
+						{
+							mStack.reserve( mRootPtr->TreeDepth()-1 );
+							node = mRootPtr;
+							start = 0;
+						}
+						else
+						{
+							node = mStack.back().first;
+							start = mStack.back().second;
+							mStack.pop_back();
+						}
+
+						while(node->TreeDepth()!=1)
+						{
+							std::pair< Rep*, Rep* > p = node->ChildPtrs();
+							mStack.push_back( std::make_pair(node, start) );
+							const size_t ll = p.first->Length();
+							if (index-start<ll)
+							{
+								node = p.first;
+							}
+							else
+							{
+								start += ll;
+								node = p.second;
+							}
+						}
+
+						// cache the leaf's storage if it's contiguous, saves a virtual call per char
+						size_t length = node->Length();
+						const CharT* data = node->GetSpan(0, length, 0, 0);
+						mData = (length==node->Length()) ? data : 0;
+
+						mPosPtr = node;
+						mLeafStart = start;
+						mCharPos = index-start;
+					}
+
+					const Rep* mPosPtr;
+					const Rep* mRootPtr;
+					const CharT* mData;
+					size_t mLeafStart, mCharPos, mIndex;
+					// ancestors of the current leaf, with the index each of them starts at
+					typedef std::vector< std::pair< const Rep*, size_t > > StackType;
+					StackType mStack;
+			};
+
+			typedef const_iterator iterator;			
+
+			// special case sub-str constructor, as per substr
+			Rope( const const_iterator& ibegin, const const_iterator& iend )
+				: mInlineLength(0)
+			{
+				if (ibegin.GetInlineData())
+					Assign( ibegin.GetInlineData()+ibegin.GetIndex(), iend.GetIndex()-ibegin.GetIndex() );
+				else
+					SetTree( SubRange( ibegin.GetRootPtr(), ibegin.GetIndex(), iend.GetIndex() ) );
+			}
+
+			const_iterator begin() const {
+                return IteratorAt(0);
+			}
+
+			const_iterator end() const {
+				return IteratorAt( size() );
+			}
+
+			//returns -1 if this < rhs, 1 if this > rhs, and 0 if this == rhs
+			int LexicographicalCompare3Way(const Rope& rhs)const
+			{
+				if (mRopeRep.GetPtr() && mRopeRep.GetPtr()==rhs.mRopeRep.GetPtr())
+					return 0;
+				return CompareRange(0, size(), rhs, 0, rhs.size());
+			}
+
+			// as per std::string::compare, returns <0, 0 or >0.
+			// len and rhsLen are clipped to the end of their strings
+			int compare(const Rope& rhs) const
+			{
+				return LexicographicalCompare3Way(rhs);
+			}
+
+			int compare(size_t pos, size_t len, const Rope& rhs) const
+			{
+				return compare(pos, len, rhs, 0, rhs.size());
+			}
+
+			int compare(size_t pos, size_t len, const Rope& rhs, size_t rhsPos, size_t rhsLen) const
+			{
+				assert(pos<=size() && rhsPos<=rhs.size());
+				return CompareRange(pos, std::min(len, size()-pos), 
+					rhs, rhsPos, std::min(rhsLen, rhs.size()-rhsPos));
+			}
+
+			int compare(size_t pos, size_t len, const StringType& rhs) const
+			{
+				assert(pos<=size());
+				return CompareRange(pos, std::min(len, size()-pos), rhs.data(), rhs.size());
+			}
+
+			int compare(size_t pos, size_t len, const CharT* rhs) const
+			{
+				assert(pos<=size());
+				return CompareRange(pos, std::min(len, size()-pos), rhs, std::char_traits<CharT>::length(rhs));
+			}
+
+			bool starts_with(const Rope& rhs) const {
+				return rhs.size()<=size() && compare(0, rhs.size(), rhs)==0;
+			}
+
+			bool starts_with(const StringType& rhs) const {
+				return rhs.size()<=size() && CompareRange(0, rhs.size(), rhs.data(), rhs.size())==0;
+			}
+
+			bool starts_with(const CharT* rhs) const {
+				const size_t length = std::char_traits<CharT>::length(rhs);
+				return length<=size() && CompareRange(0, length, rhs, length)==0;
+			}
+
+			bool ends_with(const Rope& rhs) const {
+				return rhs.size()<=size() && compare(size()-rhs.size(), rhs.size(), rhs)==0;
+			}
+
+			bool ends_with(const StringType& rhs) const {
+				return rhs.size()<=size() && CompareRange(size()-rhs.size(), rhs.size(), rhs.data(), rhs.size())==0;
+			}
+
+			bool ends_with(const CharT* rhs) const {
+				const size_t length = std::char_traits<CharT>::length(rhs);
+				return length<=size() && CompareRange(size()-length, length, rhs, length)==0;
+			}
+
+			bool operator<(const Rope& rhs)const{
+				return LexicographicalCompare3Way(rhs) < 0;
+			}
+
+			// ropes whose hashes are both already known, and differ, are rejected without comparing characters
+			bool operator==(const Rope& rhs)const{
+				if (size()!=rhs.size())
+					return false;
+				uint64_t lhsHash, rhsHash;
+				if (mRopeRep && rhs.mRopeRep && 
+					mRopeRep->CachedHash(lhsHash) && rhs.mRopeRep->CachedHash(rhsHash) && lhsHash!=rhsHash)
+					return false;
+				return LexicographicalCompare3Way(rhs) == 0;
+			}
+
+			bool operator!=(const Rope& rhs)const{
+				return !(*this==rhs);
+			}
+
+			bool operator==(const StringType& rhs)const{
+				return rhs.size()==size() && CompareRange(0, size(), rhs.data(), rhs.size())==0;
+			}
+
+			bool operator==(const CharT* rhs)const{
+				const size_t length = std::char_traits<CharT>::length(rhs);
+				return length==size() && CompareRange(0, size(), rhs, length)==0;
+			}
+            
+			// searches work a leaf at a time, scanning contiguous spans with 
+			// char_traits::find (memchr for char) rather than a char at a time, see SubstringSearcher.
+			// All return end() when there is no match
+			const_iterator find_next(const CharT rhs, const_iterator ri) const
+			{
+				return IteratorAt( FindChar(rhs, ri.GetIndex(), size()) );
+			}
+        
+			const_iterator find(const CharT rhs) const
+			{
+				return find_next(rhs, begin());
+			}
+
+			// first match of null terminated string rhs at or after ri
+			const_iterator find_next(const CharT* rhs, const_iterator ri) const
+			{
+				return IteratorAt( 
+					FindString(rhs, std::char_traits<CharT>::length(rhs), ri.GetIndex(), size()) );
+			}
+                    
+			const_iterator find(const CharT* rhs) const
+			{
+				return find_next(rhs, begin());
+			}
+
+			// last occurrence of rhs
+			const_iterator rfind(const CharT rhs) const
+			{
+				return IteratorAt( RFindChar(rhs) );
+			}
+
+			const_iterator rfind(const CharT* rhs) const
+			{
+				return IteratorAt( 
+					RFindString(rhs, std::char_traits<CharT>::length(rhs)) );
+			}
+
+			// first character (at or after ri) that is one of the null terminated set chars
+			const_iterator find_first_of(const CharT* chars, const_iterator ri) const
+			{
+				return IteratorAt( FindFirstOf(chars, ri.GetIndex()) );
+			}
+
+			const_iterator find_first_of(const CharT* chars) const
+			{
+				return find_first_of(chars, begin());
+			}
+
+			// number of occurrences of rhs
+			size_t count(const CharT rhs) const
+			{
+				size_t result = 0;
+				for_each_chunk( [&result, rhs](const CharT* data, size_t n) {
+					result += std::count(data, data+n, rhs);
+				});
+				return result;
+			}
+
+			// number of non-overlapping occurrences of null terminated string rhs
+			size_t count(const CharT* rhs) const
+			{
+				const size_t length = std::char_traits<CharT>::length(rhs);
+				if (!length)
+					return 0;
+
+				if (length==1)
+					return count(rhs[0]);
+
+				// one pass, with one searcher
+				SubstringSearcher<CharT> searcher(rhs, length);
+				size_t result = 0;
+				ForEachMatch( searcher, 0, size(), [&result](size_t) -> bool {
+					++result;
+					return true;
+				});
+				return result;
+			}
+
+			// copies the characters [pos, pos+len) to out, len is clipped to the end of the string
+			// returns the end of the copied range
+			CharT* copy(size_t pos, size_t len, CharT* out) const
+			{
+				assert(pos<=size());
+				len = std::min(len, size()-pos);
+				if (len && mRopeRep)
+					mRopeRep->Copy(pos, len, out);
+				else if (len)
+					std::char_traits<CharT>::copy(out, mInline+pos, len);
+				return out+len;
+			}
+
+			// as above, for any output iterator
+			template< typename OutputItr >
+			OutputItr copy(size_t pos, size_t len, OutputItr out) const
+			{
+				for_each_chunk(pos, len, [&out](const CharT* data, size_t n) {
+					out = std::copy(data, data+n, out);
+				});
+				return out;
+			}
+
+			// calls fn(const CharT* data, size_t length) for each contiguous span of the 
+			// characters [pos, pos+len), in order. len is clipped to the end of the string.
+			// Spans point straight into leaf storage where possible, short spans are 
+			// synthesized for leaves without it (repeated/reversed sequences).
+			// Spans are only valid for the duration of the call
+			template< typename Fn >
+			void for_each_chunk(size_t pos, size_t len, Fn fn) const
+			{
+				for_each_chunk_while(pos, len, [&fn](const CharT* data, size_t n) -> bool {
+					fn(data, n);
+					return true;
+				});
+			}
+
+			template< typename Fn >
+			void for_each_chunk(Fn fn) const
+			{
+				for_each_chunk(0, size(), fn);
+			}
+
+			// as per for_each_chunk, but stops as soon as fn returns false
+			// returns false if stopped early
+			template< typename Fn >
+			bool for_each_chunk_while(size_t pos, size_t len, Fn fn) const
+			{
+				assert(pos<=size());
+				len = std::min(len, size()-pos);
+				if (!mRopeRep)
+					return !len || fn(mInline+pos, len);
+				return mRopeRep->ForEachChunk(pos, len, fn);
+			}
+
+			// hash of the contents, equal strings hash equally however they are built.
+			// The first call is a pass over the parts of the tree not yet hashed, 
+			// after which it is cached in the nodes (and shared with ropes built from them)
+			size_t hash() const {
+				if (!mRopeRep)
+					return static_cast<size_t>( PolynomialHash::Append(0, mInline, mInlineLength) );
+				return static_cast<size_t>( mRopeRep->Hash() );
+			}
+
+			// writes the string to buf a span at a time with sputn, 
+			// returns false if buf doesn't accept all of it
+			bool write_to(std::basic_streambuf<CharT>& buf) const
+			{
+				return for_each_chunk_while(0, size(), [&buf](const CharT* data, size_t n) -> bool {
+					return buf.sputn(data, static_cast<std::streamsize>(n)) == static_cast<std::streamsize>(n);
+				});
+			}
+
+#ifndef WIN32
+			// writes the string to fd, gathering leaf storage into batches of spans for writev 
+			// (leaves without contiguous storage are copied into a buffer first).
+			// Retries partial and interrupted writes, returns false (with errno set) on error
+			bool write_to(int fd) const
+			{
+#if defined(IOV_MAX) && IOV_MAX < WRITE_BATCH_SIZE
+				const size_t batchSize = IOV_MAX;
+#else
+				const size_t batchSize = WRITE_BATCH_SIZE;
+#endif
+				std::vector< iovec > batch;
+				batch.reserve(batchSize);
+				std::vector< CharT > buffer(WRITE_BUFFER_SIZE);
+				size_t buffered = 0;
+
+				// buffered spans are in the batch, so the buffer is only reused once the batch is written
+				auto flush = [&]() -> bool {
+					size_t first = 0;
+					while(first!=batch.size())
+					{
+						const ssize_t written = writev( fd, &batch[first], static_cast<int>(batch.size()-first) );
+						if (written<0 && errno==EINTR)
+							continue;
+						if (written<0)
+							return false;
+						if (written==0)
+						{
+							// nothing written, and no error reported
+							errno = EIO;
+							return false;
+						}
+
+						size_t remaining = static_cast<size_t>(written);
+						while(remaining && remaining>=batch[first].iov_len)
+							remaining -= batch[first++].iov_len;
+						if (remaining)
+						{
+							batch[first].iov_base = static_cast<char*>(batch[first].iov_base) + remaining;
+							batch[first].iov_len -= remaining;
+						}
+					}
+					batch.clear();
+					buffered = 0;
+					return true;
+				};
+
+				if (!mRopeRep)
+				{
+					if (mInlineLength)
+					{
+						iovec span;
+						span.iov_base = const_cast<CharT*>(mInline);
+						span.iov_len = mInlineLength*sizeof(CharT);
+						batch.push_back(span);
+					}
+					return flush();
+				}
+
+				const bool result = mRopeRep->ForEachLeaf(0, size(), [&](const Rep* leaf, size_t pos, size_t len) -> bool {
+					while(len)
+					{
+						size_t n = len;
+						const CharT* data = leaf->GetSpan(pos, n, 0, 0);
+						if (!n)
+						{
+							if (buffered==buffer.size() && !flush())
+								return false;
+							n = std::min(len, buffer.size()-buffered);
+							data = &buffer[buffered];
+							leaf->Copy(pos, n, &buffer[buffered]);
+							buffered += n;
+						}
+
+						iovec span;
+						span.iov_base = const_cast<CharT*>(data);
+						span.iov_len = n*sizeof(CharT);
+						batch.push_back(span);
+						if (batch.size()==batchSize && !flush())
+							return false;
+
+						pos += n;
+						len -= n;
+					}
+					return true;
+				});
+				return result && flush();
+			}
+#endif
+
+			// walks the tree, one visit per distinct node, and describes its shape and memory use.
+			// Deep or unbalanced trees (mDepth, mLeafDepths) call for balance(), many small leaves 
+			// (mLeafSizes) or a high WastedShare() for a flat copy, Rope(GetString())
+			RopeStats stats() const
 			{
-				// nothing to do here
+				RopeStats result;
+				result.mLength = size();
+				result.mDepth = TreeDepth();
+				if (!mRopeRep)
+				{
+					result.mInline = mInlineLength!=0;
+					if (result.mInline)
+						AddLeaf(result, 0, mInlineLength);
+					return result;
+				}
+				result.mBalanced = mRopeRep->IsBalanced();
+
+				// references to each node from within the tree, the root's from this rope
+				std::vector< const Rep* > nodes;
+				std::unordered_map< const Rep*, size_t > references;
+				CollectNodes(nodes, references);
+
+				// the tree's own leaves, in order, so each is found at the depth of its first occurrence
+				{
+					std::unordered_set< const Rep* > seen;
+					std::vector< std::pair<const Rep*, size_t> > stack(1, std::make_pair(mRopeRep.GetPtr(), size_t(0)));
+					while(!stack.empty())
+					{
+						const Rep* node = stack.back().first;
+						const size_t depth = stack.back().second;
+						stack.pop_back();
+						if (!seen.insert(node).second)
+							continue;
+						if (node->Type()==Rep::ConCatNode)
+						{
+							const std::pair<Rep*, Rep*> children = node->GetChildPtrs();
+							stack.push_back( std::make_pair(children.second, depth+1) );
+							stack.push_back( std::make_pair(children.first, depth+1) );
+						}
+						else
+						{
+							AddLeaf(result, depth, node->Length());
+						}
+					}
+				}
+
+				// a node is owned if all its references come from this rope or from owned nodes,
+				// so anything referred to from outside, and everything below it, isn't
+				std::unordered_set< const Rep* > unowned;
+				std::vector< const Rep* > stack;
+				for(size_t i=0;i!=nodes.size();++i)
+				{
+					if (nodes[i]->GetRefCount() > references[nodes[i]])
+						stack.push_back(nodes[i]);
+				}
+				while(!stack.empty())
+				{
+					const Rep* node = stack.back();
+					stack.pop_back();
+					if (!unowned.insert(node).second)
+						continue;
+					const Rep* children[2];
+					for(size_t i=0, n=Children(node, children);i!=n;++i)
+						stack.push_back(children[i]);
+				}
+
+				for(size_t i=0;i!=nodes.size();++i)
+				{
+					const Rep* node = nodes[i];
+					const size_t bytes = node->AllocationSize();
+					++result.mNodes;
+					++result.mNodesOfType[node->Type()];
+					if (node->GetRefCount()>1)
+						++result.mSharedNodes;
+					result.mBytesReachable += bytes;
+					if (!unowned.count(node))
+						result.mBytesOwned += bytes;
+
+					if (node->Type()==Rep::SubStrNode)
+					{
+						const SubStrRep<CharT, SynchronizationPrimative, Allocator>* substr = 
+							static_cast< const SubStrRep<CharT, SynchronizationPrimative, Allocator>* >(node);
+						result.mBytesHidden += (substr->Sequence()->Length() - node->Length())*sizeof(CharT);
+					}
+					else if (node->Type()==Rep::StringNode)
+					{
+						const StringRep<CharT, SynchronizationPrimative, Allocator>* leaf = 
+							static_cast< const StringRep<CharT, SynchronizationPrimative, Allocator>* >(node);
+						result.mBytesSpare += (leaf->Capacity() - node->Length())*sizeof(CharT);
+					}
+				}
+				return result;
 			}
 
-			// constructs a copy of a string 
-			Rope( const StringType& str )
-			{				
-				if (str.size()>0)
+			// writes the tree to os as a Graphviz digraph, one vertex per distinct node, 
+			// so shared subtrees show as such (and are filled grey). Leaves are labelled 
+			// with (up to) their first 16 characters, as ASCII.
+			// Render with, for example, dot -Tsvg rope.dot > rope.svg
+			void write_dot(std::ostream& os) const
+			{
+				os << "digraph rope {\n\tnode [shape=box, fontname=monospace];\n";
+				if (!mRopeRep)
 				{
-					mRopeRep = new StringRep<CharT, SynchronizationPrimative>(str);
+					os << "\tn0 [label=\"inline\\nlength " << size() << "\\n";
+					WriteDotText(os, mInline, mInlineLength);
+					os << "\"];\n}\n";
+					return;
 				}
-				else
+
+				std::vector< const Rep* > nodes;
+				std::unordered_map< const Rep*, size_t > references;
+				CollectNodes(nodes, references);
+
+				std::unordered_map< const Rep*, size_t > ids;
+				for(size_t i=0;i!=nodes.size();++i)
+					ids[nodes[i]] = i;
+
+				CharT text[16];
+				for(size_t i=0;i!=nodes.size();++i)
 				{
-					mRopeRep = NullRep::Instance();
+					const Rep* node = nodes[i];
+					os << "\tn" << i << " [label=\"" << RopeStats::TypeName(node->Type())
+						<< "\\nlength " << node->Length() << "\\ndepth " << node->TreeDepth()
+						<< "\\nrefs " << node->GetRefCount();
+					if (node->Type()==Rep::SubStrNode)
+					{
+						const SubStrRep<CharT, SynchronizationPrimative, Allocator>* substr = 
+							static_cast< const SubStrRep<CharT, SynchronizationPrimative, Allocator>* >(node);
+						os << "\\n[" << substr->Start() << ", " << substr->End() << ")";
+					}
+					else if (node->Type()!=Rep::ConCatNode && node->Type()!=Rep::RepeatedSequenceNode)
+					{
+						const size_t n = std::min<size_t>(node->Length(), 16);
+						node->Copy(0, n, text);
+						os << "\\n";
+						WriteDotText(os, text, n);
+					}
+					os << "\"" << (node->GetRefCount()>1 ? ", style=filled, fillcolor=lightgrey" : "") << "];\n";
+
+					const Rep* children[2];
+					const size_t n = Children(node, children);
+					for(size_t c=0;c!=n;++c)
+					{
+						os << "\tn" << i << " -> n" << ids[children[c]];
+						if (node->Type()==Rep::ConCatNode)
+							os << (c ? " [label=R]" : " [label=L]");
+						else
+							os << " [style=dashed]";
+						os << ";\n";
+					}
 				}
+				os << "}\n";
 			}
 
-			// constructs a copy of null terminated c-string str
-			// todo - needs optimising (redundant copies)
-			Rope( const CharT* str )
-				: mRopeRep( Rope(StringType(str)).mRopeRep )
+			// parallel versions of copy, GetString, count, find and for_each_chunk.
+			// The string is split into pieces at the boundaries of its subtrees (and halves 
+			// of large leaves) down to PARALLEL_GRAIN_SIZE, each subtree's Length() giving 
+			// the offset of its piece, and the pieces are worked on by pool's threads
+
+			// as per copy
+			CharT* parallel_copy(size_t pos, size_t len, CharT* out, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
 			{
+				assert(pos<=size());
+				len = std::min(len, size()-pos);
+				ParallelForEachPiece( pool, pos, len, [this, pos, out](size_t piecePos, size_t pieceLen) {
+					copy( piecePos, pieceLen, out+(piecePos-pos) );
+				});
+				return out+len;
+			}
 
+			// as per GetString, note the string is initialised (serially) before it's copied in to,
+			// parallel_copy into an uninitialised buffer avoids that
+			StringType parallel_flatten(Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
+			{
+				StringType result(size(), CharT());
+				if (!result.empty())
+					parallel_copy( 0, size(), &result[0], pool );
+				return result;
 			}
 
-			// constructs a string of "count" repetitions of rhs
-			Rope( size_t count, const Rope& rhs )
-				: mRopeRep( new RepeatedSequenceRep<CharT, SynchronizationPrimative>(count, rhs.mRopeRep) )
+			size_t parallel_count(const CharT rhs, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
 			{
-				// nothing to do here
+				std::atomic<size_t> result(0);
+				ParallelForEachPiece( pool, 0, size(), [this, rhs, &result](size_t piecePos, size_t pieceLen) {
+					size_t count = 0;
+					for_each_chunk( piecePos, pieceLen, [rhs, &count](const CharT* data, size_t n) {
+						count += std::count(data, data+n, rhs);
+					});
+					result.fetch_add(count, std::memory_order_relaxed);
+				});
+				return result.load();
 			}
 
-			// constructs a string of "count" repetitions of char "c"
-			Rope( size_t count, CharT c )
+			// the first match, pieces after one already found are skipped
+			const_iterator parallel_find(const CharT rhs, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
 			{
-				Rope result(count/CHUNK_SIZE, Rope(StringType(CHUNK_SIZE, c)) );
-				result += StringType(count%CHUNK_SIZE, c);
-				mRopeRep = result.mRopeRep;
+				std::atomic<size_t> first( size() );
+				ParallelForEachPiece( pool, 0, size(), [this, rhs, &first](size_t piecePos, size_t pieceLen) {
+					if (piecePos<first.load(std::memory_order_relaxed))
+						KeepFirst( first, FindChar(rhs, piecePos, piecePos+pieceLen) );
+				});
+				return IteratorAt( first.load() );
 			}
 
-			// note, special case sub-str constructor for Rope::const_iterator 
-			// can be found after the iterator class
-			template< typename Itr >
-			Rope( Itr ibegin, Itr iend )
-				: mRopeRep( new StringRep<CharT, SynchronizationPrimative>(ibegin, iend) )
+			// as above, each piece is searched along with the length-1 characters after it, 
+			// for matches that straddle pieces
+			const_iterator parallel_find(const CharT* rhs, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
+			{
+				const size_t length = std::char_traits<CharT>::length(rhs);
+				if (!length)
+					return begin();
+
+				std::atomic<size_t> first( size() );
+				ParallelForEachPiece( pool, 0, size(), [this, rhs, length, &first](size_t piecePos, size_t pieceLen) {
+					if (piecePos<first.load(std::memory_order_relaxed))
+						KeepFirst( first, FindString(rhs, length, piecePos, std::min(piecePos+pieceLen+length-1, size())) );
+				});
+				return IteratorAt( first.load() );
+			}
+
+			// calls fn(size_t pos, const CharT* data, size_t length) for each contiguous span 
+			// of [pos, pos+len), where pos is the index of the span's first character.
+			// Spans are visited concurrently and in no particular order, so fn must be thread safe
+			template< typename Fn >
+			void parallel_for_each_chunk(size_t pos, size_t len, Fn fn, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
 			{
+				assert(pos<=size());
+				len = std::min(len, size()-pos);
+				ParallelForEachPiece( pool, pos, len, [this, &fn](size_t piecePos, size_t pieceLen) {
+					for_each_chunk( piecePos, pieceLen, [&fn, &piecePos](const CharT* data, size_t n) {
+						fn(piecePos, data, n);
+						piecePos += n;
+					});
+				});
+			}
 
+			template< typename Fn >
+			void parallel_for_each_chunk(Fn fn, Tasks::TaskPool& pool = Tasks::TaskPool::Default()) const
+			{
+				parallel_for_each_chunk(0, size(), fn, pool);
 			}
 
-			// concatination (string)
-			Rope& operator+=(const Rope& rhs)
+			// warning, may be expensive (one allocation, and a pass over the whole string)
+			StringType GetString() const {
+				if (!mRopeRep)
+					return StringType(mInline, mInlineLength);
+				return mRopeRep->GetString();
+			}
+
+			template< typename scalar >
+			scalar AsDecimal()const
+			{
+				scalar result = 0;
+			 
+				if (!empty())
+				{
+					const_iterator i = this->begin();
+					
+					const bool negate = (*i=='-');
+					if (negate)
+						++i;
+
+					for(;i!=this->end() && isdigit(*i);++i)
+					{
+						result *= 10;
+						result += *i - '0';
+					}
+
+					if (negate)
+						result = -result;
+				}
+			    
+				return result;
+			}
+
+
+		private:
+			// the nodes a node refers to, its children, or the sequence it is a view of, returns how many
+			static size_t Children(const Rep* node, const Rep* children[2])
+			{
+				switch(node->Type())
+				{
+					case Rep::ConCatNode:
+					{
+						const std::pair<Rep*, Rep*> pair = node->GetChildPtrs();
+						children[0] = pair.first;
+						children[1] = pair.second;
+						return 2;
+					}
+					case Rep::SubStrNode:
+						children[0] = static_cast< const SubStrRep<CharT, SynchronizationPrimative, Allocator>* >(node)->Sequence().GetPtr();
+						return 1;
+					case Rep::RepeatedSequenceNode:
+						children[0] = static_cast< const RepeatedSequenceRep<CharT, SynchronizationPrimative, Allocator>* >(node)->Sequence().GetPtr();
+						return 1;
+					default:
+						return 0;
+				}
+			}
+
+			// every node reachable from the tree, once each (parents before children), 
+			// and the number of references to each from the others, or from this rope
+			void CollectNodes(std::vector< const Rep* >& nodes, std::unordered_map< const Rep*, size_t >& references) const
+			{
+				std::vector< const Rep* > stack(1, mRopeRep.GetPtr());
+				references[mRopeRep.GetPtr()] = 1;
+				while(!stack.empty())
+				{
+					const Rep* node = stack.back();
+					stack.pop_back();
+					nodes.push_back(node);
+
+					const Rep* children[2];
+					for(size_t i=0, n=Children(node, children);i!=n;++i)
+					{
+						if (references[children[i]]++==0)
+							stack.push_back(children[i]);
+					}
+				}
+			}
+
+			static void AddLeaf(RopeStats& stats, size_t depth, size_t length)
+			{
+				++stats.mLeaves;
+				if (stats.mLeafDepths.size()<=depth)
+					stats.mLeafDepths.resize(depth+1);
+				++stats.mLeafDepths[depth];
+
+				size_t bucket = 0;
+				for(size_t n=length;n;n>>=1)
+					++bucket;
+				if (stats.mLeafSizes.size()<=bucket)
+					stats.mLeafSizes.resize(bucket+1);
+				++stats.mLeafSizes[bucket];
+			}
+
+			// characters for a dot label, anything but printable ASCII (or a quote or backslash) as '.'
+			static void WriteDotText(std::ostream& os, const CharT* text, size_t n)
+			{
+				for(size_t i=0;i!=n;++i)
+				{
+					const bool printable = text[i]>=CharT(' ') && text[i]<=CharT('~') && text[i]!=CharT('"') && text[i]!=CharT('\\');
+					os << (printable ? static_cast<char>(text[i]) : '.');
+				}
+			}
+
+			// calls fn(piecePos, pieceLen) concurrently, for pieces covering [pos, pos+len)
+			template< typename Fn >
+			void ParallelForEachPiece(Tasks::TaskPool& pool, size_t pos, size_t len, const Fn& fn) const
+			{
+				if (len<=PARALLEL_GRAIN_SIZE || !mRopeRep)
+				{
+					if (len)
+						fn(pos, len);
+					return;
+				}
+				Tasks::TaskGroup group(pool);
+				SplitPieces( group, mRopeRep.GetPtr(), 0, pos, len, fn );
+				group.Wait();
+			}
+
+			// [pos, pos+len) of node (which starts at nodeStart), subtrees left of the range's 
+			// split points are handed off as tasks and the right hand side carried on with here
+			template< typename Fn >
+			static void SplitPieces(Tasks::TaskGroup& group, const Rep* node, size_t nodeStart, size_t pos, size_t len, const Fn& fn)
 			{
-				if (rhs.size())
+				while(len>PARALLEL_GRAIN_SIZE)
 				{
-					if (size()>0)
+					if (node->TreeDepth()>1)
 					{
-						if (size()+rhs.size()<CHUNK_SIZE)
+						std::pair< Rep*, Rep* > p = node->ChildPtrs();
+						const size_t ll = p.first->Length();
+						if (pos+len<=ll)
+						{
+							node = p.first;
+						}
+						else if (pos>=ll)
 						{
-							mRopeRep = new StringRep<CharT, SynchronizationPrimative>(
-								mRopeRep->GetString(), rhs.mRopeRep->GetString()
-							);
+							pos -= ll;
+							nodeStart += ll;
+							node = p.second;
 						}
 						else
 						{
-							mRopeRep = new ConCatRep<CharT, SynchronizationPrimative>(
-								mRopeRep, rhs.mRopeRep
-							);
+							const Rep* lhs = p.first;
+							const size_t lhsLen = ll-pos;
+							group.Run( [&group, &fn, lhs, nodeStart, pos, lhsLen]() {
+								SplitPieces( group, lhs, nodeStart, pos, lhsLen, fn );
+							});
+							len -= lhsLen;
+							pos = 0;
+							nodeStart += ll;
+							node = p.second;
 						}
 					}
 					else
 					{
-						mRopeRep = rhs.mRopeRep;
+						// a large leaf, its halves are independent
+						const size_t half = len/2;
+						group.Run( [&group, &fn, node, nodeStart, pos, half]() {
+							SplitPieces( group, node, nodeStart, pos, half, fn );
+						});
+						pos += half;
+						len -= half;
 					}
-				}				
-				return *this;
+				}
+				fn(nodeStart+pos, len);
 			}
 
-			// concatination (single character)
-			// note, single character concatination does not scale well for building large strings
-			Rope& operator+=(const CharT rhs)
+			// lowers first to index, if it's lower
+			static void KeepFirst(std::atomic<size_t>& first, size_t index)
 			{
-				*this += Rope( 1, rhs );
-				return *this;
-			}
-
-			size_t size() const {
-				return mRopeRep->Length();
+				size_t current = first.load(std::memory_order_relaxed);
+				while(index<current && !first.compare_exchange_weak(current, index, std::memory_order_relaxed))
+				{
+				}
 			}
 
-			size_t length() const {
-				return mRopeRep->Length();
+			// an iterator at index, over the tree or the inline characters
+			const_iterator IteratorAt(size_t index) const {
+				return mRopeRep ? const_iterator( mRopeRep.GetPtr(), index ) : const_iterator( mInline, index );
 			}
 
-			bool empty() const {
-				return mRopeRep->Length() == 0;
+			// as per RopeRep::ForEachChunkReverse, over the whole string
+			template< typename Fn >
+			void ForEachChunkReverse(Fn fn) const
+			{
+				if (mRopeRep)
+					mRopeRep->ForEachChunkReverse( 0, size(), fn );
+				else if (mInlineLength)
+					fn( mInline, mInlineLength );
 			}
 
-			void clear(){
-				mRopeRep = NullRep::Instance();
+			// replaces the string with a copy of data[0, n), inline if it fits
+			void Assign(const CharT* data, size_t n)
+			{
+				if (n<=InlineCapacity)
+				{
+					std::char_traits<CharT>::copy( mInline, data, n );
+					mInlineLength = static_cast<unsigned char>(n);
+					mRopeRep = Ptr();
+				}
+				else
+				{
+					mRopeRep = StringRep<CharT, SynchronizationPrimative, Allocator>::Create( data, n );
+				}
 			}
 
-			void swap(Rope& rhs) {
-				std::swap( mRopeRep, rhs.mRopeRep );
+			// rhs's inline characters, if it has any, to this (whose length is already rhs's)
+			void CopyInline(const Rope& rhs)
+			{
+				if (!mRopeRep)
+					std::char_traits<CharT>::copy( mInline, rhs.mInline, mInlineLength );
 			}
 
-			CharT front()const {
-				return mRopeRep->Get(0);
-			}
+			// joins rhs on to the end of the tree
+			void Concat(const Ptr& rhs)
+			{
+				if (!rhs->Length())
+					return;
+				if (empty())
+				{
+					mRopeRep = rhs;
+					return;
+				}
 
-			CharT back()const {
-				return mRopeRep->Get(size()-1);
-			}
+				mRopeRep = new ConCatRep<CharT, SynchronizationPrimative, Allocator>(
+					Tree(), rhs
+				);
 
-			CharT operator[](size_t n) const {
-                return mRopeRep->Get(n);
+				// keep repeated appends/prepends from degenerating into a list
+				const size_t depth = mRopeRep->TreeDepth();
+				if (depth > ROPE_BALANCE_SLACK + 1 && 
+					size() < RopeRep<CharT, SynchronizationPrimative, Allocator>::MinBalancedLength(depth - ROPE_BALANCE_SLACK))
+				{
+					balance();
+				}
 			}
 
-			// create a substring from start, of size characters in length
-			Rope substr(size_t start, size_t size) const
+			// see append, false if the rightmost leaf can't be appended to
+			bool AppendInPlace(const CharT* data, size_t n)
 			{
-				Rope result;
-				result.mRopeRep = new SubStrRep<CharT, SynchronizationPrimative>(
-					start, start+size, this->mRopeRep
-				);
-				return result;
+				typedef StringRep<CharT, SynchronizationPrimative, Allocator> LeafType;
+				typedef ConCatRep<CharT, SynchronizationPrimative, Allocator> ConCatType;
+
+				// everything on the path must be unique, or the change would be seen through another reference
+				Rep* node = mRopeRep.GetPtr();
+				ConCatType* parent = 0;
+				if (!node->IsUnique())
+					return false;
+				while(node->Type()==Rep::ConCatNode)
+				{
+					parent = static_cast<ConCatType*>(node);
+					node = parent->GetChildPtrs().second;
+					if (!node->IsUnique())
+						return false;
+				}
+				if (node->Type()!=Rep::StringNode)
+					return false;
+
+				LeafType* leaf = static_cast<LeafType*>(node);
+				if (leaf->Capacity()-leaf->Length()>=n)
+				{
+					std::char_traits<CharT>::copy( leaf->Data()+leaf->Length(), data, n );
+					leaf->Extend(n);
+				}
+				else
+				{
+					const size_t length = leaf->Length()+n;
+					if (length>BUILDER_LEAF_SIZE)
+						return false;
+
+					// data may point into the old leaf, so it's copied before the old leaf is released
+					const size_t capacity = std::min<size_t>( std::max<size_t>(2*length, CHUNK_SIZE), BUILDER_LEAF_SIZE );
+					LeafType* grown = LeafType::CreateUninitialised( leaf->Length(), capacity );
+					std::char_traits<CharT>::copy( grown->Data(), leaf->Data(), leaf->Length() );
+					std::char_traits<CharT>::copy( grown->Data()+leaf->Length(), data, n );
+					grown->Extend(n);
+					if (parent)
+						parent->ReplaceRhs( Ptr(grown) );
+					else
+						mRopeRep = grown;
+				}
+
+				// and the lengths along the path down to it
+				for(node = mRopeRep.GetPtr();node->Type()==Rep::ConCatNode;node = static_cast<ConCatType*>(node)->GetChildPtrs().second)
+					node->AddLength(n);
+				return true;
 			}
 
-			class const_iterator 
+			// [start, end) of root, sharing the subtrees the range covers
+			static Ptr SubRange(const Ptr& root, size_t start, size_t end)
 			{
-				public:
-	
-					typedef typename std::forward_iterator_tag iterator_category;
-					typedef CharT value_type;
-					typedef size_t difference_type;
-					typedef const CharT* pointer;
-					typedef const CharT& reference;
+				assert(start<=end && end<=root->Length());
+				if (end-start<CHUNK_SIZE)
+					return Copy( root.GetPtr(), start, end );
 
-					// null itr - a bit like an end to an empty string
-					const_iterator()
-						: mPosPtr(0)
-						, mRootPtr(0)
-						, mCharPos(0)
-						, mIndex(0)
+				// down to the smallest subtree holding the whole range
+				const Rep* node = root.GetPtr();
+				while(node->TreeDepth()>1)
+				{
+					std::pair< Rep*, Rep* > p = node->ChildPtrs();
+					const size_t ll = p.first->Length();
+					if (end<=ll)
 					{
+						node = p.first;
 					}
-
-					// for constructing an end() 
-					// (end itr knows how long a string it belongs too, but not what string that is!)
-					explicit const_iterator(const Ptr& root, size_t end_index)
-						: mPosPtr(0)
-						, mRootPtr(root)
-						, mCharPos(0)
-						, mIndex(end_index)
+					else if (start>=ll)
 					{
+						start -= ll;
+						end -= ll;
+						node = p.second;
 					}
-
-					// a normal iterator, starts at the start of the string
-					const_iterator( const Ptr& begin )
-						: mPosPtr(begin)
-						, mRootPtr(begin)
-						, mCharPos(0)
-						, mIndex(0)
+					else
 					{
-						if (mPosPtr.GetPtr())
-						{
-                            if (mPosPtr->Length() > 0)
-                            {
-							    mStack.reserve( mPosPtr->TreeDepth()-1 );
-							    while( mPosPtr->TreeDepth()!=1 )
-							    {
-								    mStack.push_back( mPosPtr );
-								    mPosPtr = mPosPtr->GetChildren().first;
-							    }
-                            }
-                            else
-                            {
-                                // empty string, begin == end
-                                mPosPtr = 0;
-                            }
-						}
+						Rope result;
+						result.mRopeRep = Suffix( Ptr(p.first), start );
+						Rope rhs;
+						rhs.mRopeRep = Prefix( Ptr(p.second), end-ll );
+						result += rhs;
+						return result.Tree();
 					}
+				}
+				return Slice( Ptr(const_cast<Rep*>(node)), start, end );
+			}
 
-					//dereference operator, get the character at the current location
-					CharT operator*() const {
-						assert(mPosPtr->TreeDepth()==1);
-						return mPosPtr->Get(mCharPos);
+			// [0, pos) of root, descends to the leaf holding pos, the subtrees left of the path are shared
+			static Ptr Prefix(const Ptr& root, size_t pos)
+			{
+				assert(pos<=root->Length());
+				if (pos==root->Length())
+					return root;
+
+				std::vector< Ptr > parts;
+				parts.reserve( root->TreeDepth() );
+				const Rep* node = root.GetPtr();
+				while(node->TreeDepth()>1)
+				{
+					std::pair< Rep*, Rep* > p = node->ChildPtrs();
+					const size_t ll = p.first->Length();
+					if (pos>=ll)
+					{
+						parts.push_back( Ptr(p.first) );
+						pos -= ll;
+						node = p.second;
 					}
-
-					// forward stride operator, faster than random access operators for sequencial access
-					const_iterator& operator+=(size_t n) 
+					else
 					{
-						mIndex += n;
+						node = p.first;
+					}
+				}
 
-						while(mCharPos+n>=mPosPtr->Length())
-						{
-							n -= mPosPtr->Length()-mCharPos;
-							mCharPos = 0;
-							if (!mStack.empty())
-							{
-								mPosPtr = mStack.back()->GetChildren().second;
-								mStack.pop_back();
-								while( mPosPtr->TreeDepth()!=1 )
-								{
-									mStack.push_back( mPosPtr );
-									mPosPtr = mPosPtr->GetChildren().first;
-								}
-							}
-							else
-							{
-								mPosPtr = 0;
-								break;
-							}
-						}
+				// fold back up the path, so the result is no deeper than root (plus one)
+				Rope result;
+				result.mRopeRep = Slice( Ptr(const_cast<Rep*>(node)), 0, pos );
+				for(size_t i=parts.size();i!=0;--i)
+				{
+					Rope lhs;
+					lhs.mRopeRep = parts[i-1];
+					lhs += result;
+					result.swap(lhs);
+				}
+				return result.Tree();
+			}
 
-						mCharPos += n;
-						return *this;
+			// [pos, length) of root, as per Prefix
+			static Ptr Suffix(const Ptr& root, size_t pos)
+			{
+				assert(pos<=root->Length());
+				if (pos==0)
+					return root;
+
+				std::vector< Ptr > parts;
+				parts.reserve( root->TreeDepth() );
+				const Rep* node = root.GetPtr();
+				while(node->TreeDepth()>1)
+				{
+					std::pair< Rep*, Rep* > p = node->ChildPtrs();
+					const size_t ll = p.first->Length();
+					if (pos>=ll)
+					{
+						pos -= ll;
+						node = p.second;
+					}
+					else
+					{
+						parts.push_back( Ptr(p.second) );
+						node = p.first;
 					}
+				}
+
+				Rope result;
+				result.mRopeRep = Slice( Ptr(const_cast<Rep*>(node)), pos, node->Length() );
+				for(size_t i=parts.size();i!=0;--i)
+				{
+					Rope rhs;
+					rhs.mRopeRep = parts[i-1];
+					result += rhs;
+				}
+				return result.Tree();
+			}
+
+			// [start, end) of a leaf, short pieces are copied, longer ones share the leaf.
+			// Slices of slices refer straight to the underlying sequence (and through to 
+			// its subtrees if it isn't reversed), rather than nesting
+			static Ptr Slice(const Ptr& leaf, size_t start, size_t end)
+			{
+				assert(start<=end && end<=leaf->Length());
+				if (start==0 && end==leaf->Length())
+					return leaf;
+
+				if (leaf->Type()==Rep::FillNode)
+				{
+					return Fill( end-start, static_cast< const FillRep<CharT, SynchronizationPrimative, Allocator>* >( leaf.GetPtr() )->Char() );
+				}
+
+				// a forward slice of a substring is a range of its sequence, whose own leaves are sliced by the same rule
+				const SubStrRep<CharT, SynchronizationPrimative, Allocator>* subStr = (leaf->Type()==Rep::SubStrNode) ? 
+					static_cast< const SubStrRep<CharT, SynchronizationPrimative, Allocator>* >( leaf.GetPtr() ) : 0;
+				if (subStr && !subStr->IsReversed())
+					return SubRange( subStr->Sequence(), subStr->Start()+start, subStr->Start()+end );
+
+				// otherwise the slice keeps all of the leaf (or the reversed sequence) alive, see ROPE_SLICE_SHARE_RATIO
+				const size_t retained = subStr ? subStr->Sequence()->Length() : leaf->Length();
+				if (end-start<CHUNK_SIZE || end-start < retained/ROPE_SLICE_SHARE_RATIO)
+					return Copy( leaf.GetPtr(), start, end );
+
+				if (leaf->Type()==Rep::MappedNode)
+				{
+					const MappedRep<CharT, SynchronizationPrimative, Allocator>* mapped = 
+						static_cast< const MappedRep<CharT, SynchronizationPrimative, Allocator>* >( leaf.GetPtr() );
+					return Ptr( new MappedRep<CharT, SynchronizationPrimative, Allocator>( mapped->File(), mapped->Data()+start, end-start ) );
+				}
+				if (subStr)
+				{
+					return Ptr( new SubStrRep<CharT, SynchronizationPrimative, Allocator>(
+						subStr->Start()-start, subStr->Start()-end, subStr->Sequence()
+					) );
+				}
+				return Ptr( new SubStrRep<CharT, SynchronizationPrimative, Allocator>(start, end, leaf) );
+			}
 
-					// reverse stride operator, expensive 
-					// - prefer random access operators on parent string for random access to char data
-					// (constructs a new interator, forward strides to the right location and copys)
-					const_iterator& operator-=(size_t n) 
-					{
-						assert( mIndex >= n );
-						const_iterator result(mRootPtr);
+			// a perfectly balanced tree over leaves[begin, end)
+			static Ptr BuildBalanced(const std::vector< Ptr >& leaves, size_t begin, size_t end)
+			{
+				assert(begin<end);
+				if (end-begin==1)
+					return leaves[begin];
+				const size_t middle = begin + (end-begin)/2;
+				return Ptr( new ConCatRep<CharT, SynchronizationPrimative, Allocator>(
+					BuildBalanced(leaves, begin, middle), BuildBalanced(leaves, middle, end)
+				) );
+			}
 
-						result += (mIndex-n);
+			// count copies of c, short runs are plain leaves
+			static Ptr Fill(size_t count, CharT c)
+			{
+				if (count==0)
+					return NullRep::Instance();
+				if (count<CHUNK_SIZE)
+				{
+					StringRep<CharT, SynchronizationPrimative, Allocator>* result = 
+						StringRep<CharT, SynchronizationPrimative, Allocator>::CreateUninitialised( count, count );
+					std::char_traits<CharT>::assign( result->Data(), count, c );
+					return Ptr(result);
+				}
+				return Ptr( FillRep<CharT, SynchronizationPrimative, Allocator>::Create(count, c) );
+			}
 
-						// swap is faster than copy, and the old copy is thrown away
-						this->swap(result);
+			// [start, end) of node, copied into a new leaf
+			static Ptr Copy(const Rep* node, size_t start, size_t end)
+			{
+				if (start==end)
+					return NullRep::Instance();
+				StringRep<CharT, SynchronizationPrimative, Allocator>* result = 
+					StringRep<CharT, SynchronizationPrimative, Allocator>::CreateUninitialised( end-start, end-start );
+				node->Copy( start, end-start, result->Data() );
+				return Ptr(result);
+			}
 
-						return *this;
+			// position within one side of a comparison, walks the leaves of [pos, pos+len) in order
+			class CompareCursor
+			{
+				public:
+					CompareCursor(const RopeRep<CharT, SynchronizationPrimative, Allocator>* root, size_t pos, size_t len)
+						: mNode(len ? root : 0)
+						, mPos(pos)
+						, mRemaining(len)
+					{ 
+						mStack.reserve( root->TreeDepth() );
 					}
 
-					// pre increment, pretty fast
-					const_iterator& operator++() 
-					{
-						*this += 1;
-						return *this;
+					bool AtEnd() const {
+						return !mNode;
 					}
 
-					// post increment, makes a copy of the iterator, expensive on complex strings
-					// to be generally avoided in favor of preincrement
-					const_iterator operator++(int) 
-					{
-						const_iterator was(*this);
-                        ++*this;
-						return was;
+					// a subtree that is wholly in range, for skipping shared subtrees, or null
+					const RopeRep<CharT, SynchronizationPrimative, Allocator>* WholeNode() const {
+						return mPos==0 && mNode->Length()<=mRemaining ? mNode : 0;
 					}
 
-					// predecrement, expensive compared even to post increment
-					// (see reverse stride operator for more info)
-					const_iterator& operator--()
-					{
-						*this -= 1;
-						return *this;
+					bool AtLeaf() const {
+						return mNode->TreeDepth()==1;
 					}
 
-					// post decrement, makes a copy of the iterator, expensive on complex strings
-					// not notably more expensive than predecrement
-					const_iterator operator--(int) 
-					{
-						assert( mIndex >= 1 );
-						const_iterator result(mRootPtr);
-
-						result += (mIndex-1);
-						this->swap(result);
-
-						return result;
+					size_t NodeRemaining() const {
+						return std::min(mNode->Length()-mPos, mRemaining);
 					}
 
-					// comparison, usually fast, but poor worst-case performance 
-					// (worst case => iterators are the same, deep/complex tree)
-					bool operator!=(const const_iterator& rhs)
+					// steps into the child containing mPos, keeping the right child for later if it is in range
+					void Descend()
 					{
-						if (mIndex!=rhs.mIndex ||
-							mCharPos!=rhs.mCharPos ||
-							mPosPtr!=rhs.mPosPtr ||
-							mStack.size()!=rhs.mStack.size()) return true;
-
-						for(size_t i=0;i!=mStack.size();++i)
-							if (mStack[i]!=rhs.mStack[i]) return true;
-
-						// should only get here if on end() of different but equal sized strings
-                        return mRootPtr!=rhs.mRootPtr;
+						std::pair< RopeRep<CharT, SynchronizationPrimative, Allocator>*, RopeRep<CharT, SynchronizationPrimative, Allocator>* > p = mNode->ChildPtrs();
+						const size_t ll = p.first->Length();
+						if (mPos>=ll)
+						{
+							mPos -= ll;
+							mNode = p.second;
+						}
+						else
+						{
+							if (mPos+mRemaining>ll)
+								mStack.push_back( p.second );
+							mNode = p.first;
+						}
 					}
 
-					// comparison, as per != 
-					bool operator==(const const_iterator& rhs)
+					// contiguous span of (at most maxLen of) the current leaf
+					const CharT* Span(size_t maxLen, size_t& n, CharT* buffer)
 					{
-						return !(*this != rhs);
+						n = std::min(NodeRemaining(), maxLen);
+						return mNode->GetSpan(mPos, n, buffer, SPAN_BUFFER_SIZE);
 					}
 
-					difference_type distance(const const_iterator& rhs) const {
-						return rhs.mIndex - mIndex;
+					void Advance(size_t n)
+					{
+						assert(n<=NodeRemaining());
+						mPos += n;
+						mRemaining -= n;
+						if (!mRemaining)
+						{
+							mNode = 0;
+						}
+						else if (mPos==mNode->Length())
+						{
+							mNode = mStack.back();
+							mStack.pop_back();
+							mPos = 0;
+						}
 					}
 
-					difference_type operator-(const const_iterator& rhs) const {
-						return rhs.distance(*this);
-					}
+				private:
+					std::vector< const RopeRep<CharT, SynchronizationPrimative, Allocator>* > mStack;
+					const RopeRep<CharT, SynchronizationPrimative, Allocator>* mNode;
+					size_t mPos;
+					size_t mRemaining;
+			};
 
-					size_t GetIndex() const {
-						return mIndex;
-					}
+			// compares [pos, pos+len) with rhs's [rhsPos, rhsPos+rhsLen), returning -1, 0 or 1.
+			// Skips subtrees the two share, and compares leaves span against span with char_traits (memcmp)
+			int CompareRange(size_t pos, size_t len, const Rope& rhs, size_t rhsPos, size_t rhsLen) const
+			{
+				if (!rhs.mRopeRep)
+					return CompareRange(pos, len, rhs.mInline+rhsPos, rhsLen);
+				if (!mRopeRep)
+					return -rhs.CompareRange(rhsPos, rhsLen, mInline+pos, len);
 
-					Ptr GetRootPtr() const {
-						return mRootPtr;
-					}					
+				CompareCursor lhsCursor(mRopeRep.GetPtr(), pos, len);
+				CompareCursor rhsCursor(rhs.mRopeRep.GetPtr(), rhsPos, rhsLen);
+				CharT lhsBuffer[SPAN_BUFFER_SIZE], rhsBuffer[SPAN_BUFFER_SIZE];
 
-					void swap(const_iterator &rhs)
+				while(!lhsCursor.AtEnd() && !rhsCursor.AtEnd())
+				{
+					const RopeRep<CharT, SynchronizationPrimative, Allocator>* shared = lhsCursor.WholeNode();
+					if (shared && shared==rhsCursor.WholeNode())
 					{
-						std::swap(mPosPtr, rhs.mPosPtr);
-						std::swap(mRootPtr, rhs.mRootPtr);
-						std::swap(mCharPos, rhs.mCharPos);
-						std::swap(mIndex, rhs.mIndex);
-						std::swap(mStack, rhs.mStack);
+						//same sub tree, can skip as are equal
+						lhsCursor.Advance( shared->Length() );
+						rhsCursor.Advance( shared->Length() );
 					}
+					else if (!lhsCursor.AtLeaf() && 
+						(rhsCursor.AtLeaf() || lhsCursor.NodeRemaining()>=rhsCursor.NodeRemaining()))
+					{
+						//dig down into the larger sub tree, looking for one the other side shares
+						lhsCursor.Descend();
+					}
+					else if (!rhsCursor.AtLeaf())
+					{
+						rhsCursor.Descend();
+					}
+					else
+					{
+						size_t lhsN, rhsN;
+						const CharT* l = lhsCursor.Span( SPAN_BUFFER_SIZE, lhsN, lhsBuffer );
+						const CharT* r = rhsCursor.Span( lhsN, rhsN, rhsBuffer );
+						const size_t n = std::min(lhsN, rhsN);
+						const int result = std::char_traits<CharT>::compare(l, r, n);
+						if (result)
+							return result<0 ? -1 : 1;
+						lhsCursor.Advance(n);
+						rhsCursor.Advance(n);
+					}
+				}
 
-				private:
-					Ptr mPosPtr, mRootPtr;
-					size_t mCharPos, mIndex;					
-					typedef std::vector< Ptr > StackType;
-					StackType mStack;
-			};
-
-			typedef const_iterator iterator;			
+				if (lhsCursor.AtEnd())
+					return rhsCursor.AtEnd() ? 0 : -1;
+				return 1;
+			}
 
-			// special case sub-str constructor
-			Rope( const const_iterator& ibegin, const const_iterator& iend )
+			// compares [pos, pos+len) with rhs[0, rhsLen), returning -1, 0 or 1
+			int CompareRange(size_t pos, size_t len, const CharT* rhs, size_t rhsLen) const
 			{
-                if (ibegin.distance(iend)>CHUNK_SIZE)
-                {
-                    mRopeRep = new SubStrRep<CharT, SynchronizationPrimative>(
-                    	ibegin.GetIndex(), iend.GetIndex(), ibegin.GetRootPtr()
-                    );
-                }
-                else 
-                {
-                    mRopeRep = new StringRep<CharT, SynchronizationPrimative>(
-                    	ibegin, iend
-                    );
-                }
-
+				const size_t n = std::min(len, rhsLen);
+				int result = 0;
+				for_each_chunk_while( pos, n, [&result, &rhs](const CharT* data, size_t m) -> bool {
+					result = std::char_traits<CharT>::compare(data, rhs, m);
+					rhs += m;
+					return result==0;
+				});
+				if (result)
+					return result<0 ? -1 : 1;
+				return len<rhsLen ? -1 : (rhsLen<len ? 1 : 0);
 			}
 
-			const_iterator begin() const {
-                return const_iterator(mRopeRep);
+			// index of the first c in [pos, end), or size()
+			size_t FindChar(CharT c, size_t pos, size_t end) const
+			{
+				size_t result = size();
+				size_t base = pos;
+				for_each_chunk_while( pos, end-pos, [&](const CharT* data, size_t n) -> bool {
+					const CharT* found = std::char_traits<CharT>::find(data, n, c);
+					if (found)
+					{
+						result = base + (found-data);
+						return false;
+					}
+					base += n;
+					return true;
+				});
+				return result;
 			}
 
-			const_iterator end() const {
-				//end is null ptr
-				return const_iterator( mRopeRep, size() );
+			// index of the last c, or size()
+			size_t RFindChar(CharT c) const
+			{
+				size_t result = size();
+				size_t end = size();
+				ForEachChunkReverse( [&](const CharT* data, size_t n) -> bool {
+					for(size_t i=n;i!=0;--i)
+					{
+						if (data[i-1]==c)
+						{
+							result = end-n+i-1;
+							return false;
+						}
+					}
+					end -= n;
+					return true;
+				});
+				return result;
 			}
 
-			//returns -1 if this < rhs, 1 if this > rhs, and 0 if this == rhs
-			int LexicographicalCompare3Way(const Rope& rhs)const
+			// index of the first occurrence of needle[0, length) within [pos, end), or size()
+			size_t FindString(const CharT* needle, size_t length, size_t pos, size_t end) const
 			{
-				std::vector< RopeRep<CharT, SynchronizationPrimative>* > lhsStack, rhsStack;
-				size_t lhsCharPos(0),rhsCharPos(0);
-				RopeRep<CharT, SynchronizationPrimative>* lhsPosPtr(mRopeRep.GetPtr());
-				RopeRep<CharT, SynchronizationPrimative>* rhsPosPtr(rhs.mRopeRep.GetPtr());
-
-				lhsStack.reserve( lhsPosPtr->TreeDepth()-1 );
-				rhsStack.reserve( rhsPosPtr->TreeDepth()-1 );
+				if (length==0)
+					return pos;
+				if (length==1)
+					return FindChar(needle[0], pos, end);
+				if (pos+length>end)
+					return size();
+
+				SubstringSearcher<CharT> searcher(needle, length);
+				size_t result = size();
+				ForEachMatch( searcher, pos, end, [&result](size_t match) -> bool {
+					result = match;
+					return false;
+				});
+				return result;
+			}
 
-				//const size_t rhsLength = rhs.size();
-				//const size_t minLength = std::min(size(),rhsLength);
-				size_t absCharPos = 0;
-				
-				while(lhsPosPtr && rhsPosPtr)
-				{
-					//travel down both trees, trying to identify shared sub trees
-					if (lhsPosPtr!=rhsPosPtr)
+			// calls fn(index) for each non-overlapping match of searcher's needle within [pos, end), 
+			// in order, until fn returns false.
+			// Matches can straddle spans, so the last length-1 characters of the spans seen so far 
+			// are carried over, and searched together with the start of the next span
+			template< typename Fn >
+			void ForEachMatch(SubstringSearcher<CharT>& searcher, size_t pos, size_t end, Fn fn) const
+			{
+				const size_t length = searcher.Length();
+				assert(length>1);
+				CharT* bridge = searcher.Bridge();
+				size_t carried = 0;
+
+				// matches starting before next overlap the last one reported
+				size_t next = pos;
+				size_t base = pos;
+				for_each_chunk_while( pos, end-pos, [&](const CharT* data, size_t n) -> bool {
+					if (carried)
 					{
-						if (lhsPosPtr->TreeDepth()==1 && rhsPosPtr->TreeDepth()==1)
+						// matches starting in the carried characters
+						const size_t k = std::min(n, length-1);
+						std::char_traits<CharT>::copy( bridge+carried, data, k );
+						for(size_t j=0;;)
 						{
-							while(lhsCharPos!=lhsPosPtr->Length() && rhsCharPos!=rhsPosPtr->Length()) {
-								CharT l = lhsPosPtr->Get(lhsCharPos++);
-								CharT r = rhsPosPtr->Get(rhsCharPos++);
-								++absCharPos;
-								if (l<r) return -1;
-								if (r<l) return 1;
-							} 
-
-							if (lhsCharPos==lhsPosPtr->Length())
-							{
-								lhsCharPos = 0;
-								if (lhsStack.empty())
-								{
-									lhsPosPtr = 0;
-								}
-								else
-								{
-									lhsPosPtr = lhsStack.back()->GetChildren().second.GetPtr();
-								}								
-							}
-
-							if (rhsCharPos==rhsPosPtr->Length())
+							const size_t i = j + searcher.Find( bridge+j, carried+k-j );
+							if (i>=carried)
+								break;
+							const size_t match = base-carried+i;
+							if (match>=next)
 							{
-								rhsCharPos = 0;
-								if (rhsStack.empty())
-								{
-									rhsPosPtr = 0;
-								}
-								else
-								{
-									rhsPosPtr = rhsStack.back()->GetChildren().second.GetPtr();
-								}								
+								if (!fn(match))
+									return false;
+								next = match+length;
 							}
+							j = i+1;
 						}
-						else 
-						{
-							//left hand sub tree fragment is larger than right hand sub tree fragment
-							if ( lhsPosPtr->TreeDepth()>1 && 
-								 ((lhsPosPtr->Length()-lhsCharPos > rhsPosPtr->Length()-rhsCharPos) || rhsPosPtr->TreeDepth() == 1)
-								)
-							{
-								//dig down into left hand sub tree							
-								assert(lhsPosPtr->TreeDepth()>1);
-								lhsStack.push_back( lhsPosPtr );
+					}
 
-								lhsCharPos = 0;
-								lhsPosPtr = lhsPosPtr->GetChildren().first.GetPtr();
-							}
-							//right hand sub tree it larger than left hand sub tree
-							//or sub trees are of equal size
-							else
-							{
-								assert(rhsPosPtr->TreeDepth()>1);
-								rhsStack.push_back( rhsPosPtr );
+					for(size_t j=(next>base) ? next-base : 0;j<n;)
+					{
+						const size_t i = j + searcher.Find( data+j, n-j );
+						if (i>=n)
+							break;
+						if (!fn(base+i))
+							return false;
+						next = base+i+length;
+						j = i+length;
+					}
 
-								rhsCharPos = 0;
-								rhsPosPtr = rhsPosPtr->GetChildren().first.GetPtr();
-							}
-						}
+					if (n>=length-1)
+					{
+						std::char_traits<CharT>::copy( bridge, data+n-(length-1), length-1 );
+						carried = length-1;
 					}
 					else
 					{
-						//same sub tree, can skip as are equal
-						assert(lhsPosPtr->Length()==rhsPosPtr->Length());
-						absCharPos += lhsPosPtr->Length();
-						
-						lhsCharPos = 0;
-						if (lhsStack.empty())
-						{
-							lhsPosPtr = 0;
-						}
-						else
-						{
-							lhsPosPtr = lhsStack.back()->GetChildren().second.GetPtr();
-							lhsStack.pop_back();
-						}
+						// the span is already after the carried characters, if there were any
+						if (!carried)
+							std::char_traits<CharT>::copy( bridge, data, n );
+						const size_t total = carried+n;
+						const size_t keep = std::min(total, length-1);
+						std::char_traits<CharT>::move( bridge, bridge+total-keep, keep );
+						carried = keep;
+					}
+					base += n;
+					return true;
+				});
+			}
 
-						rhsCharPos = 0;
-						if (rhsStack.empty())
-						{
-							rhsPosPtr = 0;
-						}
-						else
+			// index of the last occurrence of needle[0, length), or size().
+			// As per ForEachMatch, but walking backward, carrying the first length-1 characters
+			size_t RFindString(const CharT* needle, size_t length) const
+			{
+				if (length==0)
+					return size();
+				if (length==1)
+					return RFindChar(needle[0]);
+				if (length>size())
+					return size();
+
+				SubstringSearcher<CharT> searcher(needle, length);
+				CharT* bridge = searcher.Bridge();
+				size_t carried = 0;
+				size_t result = size();
+				size_t end = size();
+				ForEachChunkReverse( [&](const CharT* data, size_t n) -> bool {
+					const size_t start = end-n;
+					const size_t k = std::min(n, length-1);
+					if (carried)
+					{
+						// the end of this span, followed by the carried characters
+						std::char_traits<CharT>::move( bridge+k, bridge, carried );
+						std::char_traits<CharT>::copy( bridge, data+n-k, k );
+						const size_t i = searcher.FindLast( bridge, k+carried );
+						if (i<k)
 						{
-							rhsPosPtr = rhsStack.back()->GetChildren().second.GetPtr();
-							rhsStack.pop_back();						
+							result = start+n-k+i;
+							return false;
 						}
-					}					
-				}
+					}
 
-				//reached end of lhs string
-				if (!lhsPosPtr)
-				{
-					//reached end of rhs string
-					if (!rhsPosPtr)
+					const size_t i = searcher.FindLast(data, n);
+					if (i<n)
 					{
-						//strings are equal
-						return 0;
+						result = start+i;
+						return false;
+					}
+
+					if (n>=length-1)
+					{
+						std::char_traits<CharT>::copy( bridge, data, length-1 );
+						carried = length-1;
 					}
 					else
 					{
-						//strings are equal up to end of lhs
-						//but rhs is longer, so lhs < rhs
-						return -1; 
+						// the span is already before the carried characters, if there were any
+						if (!carried)
+							std::char_traits<CharT>::copy( bridge, data, n );
+						carried = std::min(carried+n, length-1);
+					}
+					end = start;
+					return true;
+				});
+				return result;
+			}
+
+			// index of the first character at or after pos that is in the null terminated set chars, 
+			// or size().  Membership is tested against a table of the chars' low 8 bits first
+			size_t FindFirstOf(const CharT* chars, size_t pos) const
+			{
+				const size_t setSize = std::char_traits<CharT>::length(chars);
+				bool maybeMember[256] = { false };
+				for(size_t i=0;i!=setSize;++i)
+					maybeMember[ static_cast<size_t>(chars[i]) & 0xFF ] = true;
+
+				size_t result = size();
+				size_t base = pos;
+				for_each_chunk_while( pos, size()-pos, [&](const CharT* data, size_t n) -> bool {
+					for(size_t i=0;i!=n;++i)
+					{
+						if (maybeMember[ static_cast<size_t>(data[i]) & 0xFF ] && 
+							(sizeof(CharT)==1 || std::char_traits<CharT>::find(chars, setSize, data[i])))
+						{
+							result = base+i;
+							return false;
+						}
 					}
+					base += n;
+					return true;
+				});
+				return result;
+			}
+
+		protected:
+			friend class RopeBuilder<CharT, SynchronizationPrimative, Allocator>;
+			friend class ConcurrentRope<CharT, Allocator>;
+
+			// the string as a tree, inline characters are copied into a new leaf
+			Ptr Tree() const
+			{
+				if (mRopeRep)
+					return mRopeRep;
+				if (!mInlineLength)
+					return NullRep::Instance();
+				return Ptr( StringRep<CharT, SynchronizationPrimative, Allocator>::Create( mInline, mInlineLength ) );
+			}
+
+			// replaces the string with tree, short strings are copied inline instead
+			void SetTree(const Ptr& tree)
+			{
+				const size_t n = tree->Length();
+				if (n<=InlineCapacity)
+				{
+					tree->Copy( 0, n, mInline );
+					mInlineLength = static_cast<unsigned char>(n);
+					mRopeRep = Ptr();
 				}
 				else
 				{
-					//should have reached end of rhs string
-					assert(!rhsPosPtr);
-
-					//strings are equal up to end of rhs
-					//but lhs is longer, so rhs < lhs
-					return 1; 
+					mRopeRep = tree;
 				}
 			}
 
-			bool operator<(const Rope& rhs)const{
-				return LexicographicalCompare3Way(rhs) < 0;
+			enum { InlineCapacity = (ROPE_INLINE_SIZE-1)/sizeof(CharT) };
+
+			// null while the string is held inline, in mInline[0, mInlineLength)
+			Ptr mRopeRep;
+			CharT mInline[InlineCapacity];
+			unsigned char mInlineLength;
+	};
+
+	// builds a rope from a sequence of appends in one pass, without a flat copy of the whole string.
+	// Characters are packed into leaves of leafSize, and the tree is assembled bottom up as they 
+	// fill, like a binary counter: subtrees of equal depth are joined as soon as there are two, 
+	// so at most one partly built subtree per level is held, and the result is balanced
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator = Allocation::HeapAllocator >
+	class RopeBuilder
+	{
+		public:
+			typedef Rope<CharT, SynchronizationPrimative, Allocator> RopeType;
+			typedef typename RopeType::Ptr Ptr;
+			typedef typename RopeType::StringType StringType;
+
+			explicit RopeBuilder(size_t leafSize = BUILDER_LEAF_SIZE)
+				: mLeafSize(leafSize)
+				, mSize(0)
+			{
+				assert(leafSize>0);
 			}
 
-			bool operator==(const Rope& rhs)const{
-				return LexicographicalCompare3Way(rhs) == 0;
+			size_t size() const {
+				return mSize;
 			}
 
-			bool operator!=(const Rope& rhs)const{
-				return LexicographicalCompare3Way(rhs) != 0;
+			void append(const CharT* data, size_t n)
+			{
+				while(n)
+				{
+					size_t space;
+					CharT* out = buffer(space);
+					const size_t m = std::min(n, space);
+					std::char_traits<CharT>::copy(out, data, m);
+					commit(m);
+					data += m;
+					n -= m;
+				}
 			}
 
-			bool operator==(const StringType& rhs)const{
-				if (rhs.size()!=size()) return false;
-				const_iterator e = end();
-				const_iterator ri = begin();
-				typename StringType::const_iterator si = rhs.begin();
-				for(;ri!=e;++ri,++si)
-					if (*si!=*ri)
-						return false;
+			void append(const StringType& str) {
+				append(str.data(), str.size());
+			}
 
-				return true;
+			void append(CharT c) {
+				append(&c, 1);
 			}
 
-			bool operator==(const CharT* rhs)const{
-				const_iterator e = end();
-				const_iterator ri = begin();
-				for(;ri!=e;++ri,++rhs)
+			// short ropes are copied into the current leaf, longer ones are added as they are
+			void append(const RopeType& rope)
+			{
+				if (rope.size()<mLeafSize)
 				{
-					if (*rhs!=*ri || *rhs==0)
-						return false;
+					rope.for_each_chunk( [this](const CharT* data, size_t n) {
+						append(data, n);
+					});
+				}
+				else
+				{
+					CloseLeaf();
+					Push( rope.Tree() );
+					mSize += rope.size();
 				}
+			}
 
-				return *rhs==0;
+			// space to write characters straight into the current leaf, n is set to how many fit.
+			// Follow with commit() of however many were written
+			CharT* buffer(size_t& n)
+			{
+				if (!mLeaf.GetPtr())
+					mLeaf = LeafType::CreateUninitialised(0, mLeafSize);
+				LeafType* leaf = static_cast<LeafType*>( mLeaf.GetPtr() );
+				n = leaf->Capacity()-leaf->Length();
+				return leaf->Data()+leaf->Length();
 			}
-            
-            const_iterator find_next(const CharT rhs, const_iterator ri) const
-            {
-                const_iterator e = end();
-                for(;ri!=e;++ri)
-                    if (*ri==rhs)
-                        break;
-                return ri;
-            }
-        
-            const_iterator find(const CharT rhs) const
-            {
-                return find_next(rhs, begin());
-            }
-                    
-            const_iterator find(const CharT* rhs) const
-            {
-                const_iterator ri = begin();
-                const_iterator e = end();
-                for(;ri!=e;++ri)
-				{
-                    if (*rhs==*ri)
-                    {
-                        const CharT* rhs_pos = rhs;
-                        const_iterator pos = ri;
-                        do {
-                            rhs_pos ++;
-                            pos ++;
-                        } while (*rhs_pos && pos!=e && *rhs_pos==*pos);
-                        if (*rhs_pos==0) 
-                            return ri;
-					}
-				}
-                return e;
-            }
-
-			// warning, may be expensive
-			StringType GetString() const {
-				return mRopeRep->GetString();
+
+			// adds the n characters written to buffer()
+			void commit(size_t n)
+			{
+				if (!n)
+					return;
+				LeafType* leaf = static_cast<LeafType*>( mLeaf.GetPtr() );
+				assert(leaf);
+				leaf->Extend(n);
+				mSize += n;
+				if (leaf->Length()==leaf->Capacity())
+					CloseLeaf();
 			}
 
-			template< typename scalar >
-			scalar AsDecimal()const
+			// the rope built so far, and resets the builder
+			RopeType finish()
 			{
-				scalar result = 0;
-			 
-				if (!empty())
+				CloseLeaf();
+				RopeType result;
+				if (!mStack.empty())
 				{
-					const_iterator i = this->begin();
-					
-					const bool negate = (*i=='-');
-					if (negate)
-						++i;
+					Ptr tree = mStack.back();
+					for(size_t i=mStack.size()-1;i!=0;--i)
+						tree = Ptr( new ConCatRep<CharT, SynchronizationPrimative, Allocator>(mStack[i-1], tree) );
+					result.SetTree(tree);
+				}
+				mStack.clear();
+				mSize = 0;
+				return result;
+			}
 
-					for(;i!=this->end() && isdigit(*i);++i)
-					{
-						result *= 10;
-						result += *i - '0';
-					}
+		private:
+			typedef StringRep<CharT, SynchronizationPrimative, Allocator> LeafType;
 
-					if (negate)
-						result = -result;
+			// adds the current leaf to the tree, a mostly empty leaf is copied down to size
+			void CloseLeaf()
+			{
+				LeafType* leaf = static_cast<LeafType*>( mLeaf.GetPtr() );
+				if (leaf && leaf->Length())
+				{
+					if (leaf->Length() < leaf->Capacity()/2)
+						Push( Ptr( LeafType::Create(leaf->Data(), leaf->Length()) ) );
+					else
+						Push( mLeaf );
 				}
-			    
-				return result;
+				mLeaf = 0;
 			}
 
+			// stack depths decrease from bottom to top, a subtree at least as deep as 
+			// the one below it is joined to it (carried, as per incrementing a binary counter)
+			void Push(const Ptr& tree)
+			{
+				mStack.push_back(tree);
+				while(mStack.size()>1 && mStack[mStack.size()-2]->TreeDepth()<=mStack.back()->TreeDepth())
+				{
+					Ptr rhs = std::move(mStack.back());
+					mStack.pop_back();
+					mStack.back() = Ptr( new ConCatRep<CharT, SynchronizationPrimative, Allocator>(mStack.back(), rhs) );
+				}
+			}
 
-		protected:
-			Ptr mRopeRep;
+			const size_t mLeafSize;
+			size_t mSize;
+			Ptr mLeaf;
+			std::vector< Ptr > mStack;
 	};
 
-	template< typename CharT, typename SynchronizationPrimative >
-	Rope<CharT, SynchronizationPrimative> operator+(
-		const Rope<CharT, SynchronizationPrimative>& lhs, 
-		const Rope<CharT, SynchronizationPrimative>& rhs)
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	Rope<CharT, SynchronizationPrimative, Allocator> Rope<CharT, SynchronizationPrimative, Allocator>::read_from(
+		std::basic_istream<CharT>& is)
+	{
+		RopeBuilder<CharT, SynchronizationPrimative, Allocator> builder;
+		const typename std::basic_istream<CharT>::sentry sentry(is, true);
+		if (!sentry)
+			return Rope();
+
+		// a short read isn't necessarily the end, only reading nothing is
+		std::basic_streambuf<CharT>* buf = is.rdbuf();
+		bool extracted = false;
+		for(;;)
+		{
+			size_t space;
+			CharT* out = builder.buffer(space);
+			const std::streamsize n = buf->sgetn( out, static_cast<std::streamsize>(space) );
+			if (n<=0)
+				break;
+			builder.commit( static_cast<size_t>(n) );
+			extracted = true;
+		}
+		is.setstate( extracted ? std::ios_base::eofbit : (std::ios_base::eofbit | std::ios_base::failbit) );
+		return builder.finish();
+	}
+
+#ifndef WIN32
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	Rope<CharT, SynchronizationPrimative, Allocator> Rope<CharT, SynchronizationPrimative, Allocator>::read_from(
+		int fd, bool* ok)
+	{
+		RopeBuilder<CharT, SynchronizationPrimative, Allocator> builder;
+		if (ok)
+			*ok = true;
+
+		// bytes of a character split across reads, moved to the front of the next read
+		char partial[sizeof(CharT)];
+		size_t partialBytes = 0;
+		for(;;)
+		{
+			size_t space;
+			char* out = reinterpret_cast<char*>( builder.buffer(space) );
+			memcpy(out, partial, partialBytes);
+
+			const ssize_t n = read( fd, out+partialBytes, space*sizeof(CharT)-partialBytes );
+			if (n<0 && errno==EINTR)
+				continue;
+			if (n<0 && ok)
+				*ok = false;
+			if (n<=0)
+				break;
+
+			const size_t bytes = partialBytes+static_cast<size_t>(n);
+			partialBytes = bytes%sizeof(CharT);
+			memcpy(partial, out+bytes-partialBytes, partialBytes);
+			builder.commit( bytes/sizeof(CharT) );
+		}
+
+		// ended part way through a character
+		if (partialBytes && ok && *ok)
+		{
+			*ok = false;
+			errno = EILSEQ;
+		}
+		return builder.finish();
+	}
+#endif
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	Rope<CharT, SynchronizationPrimative, Allocator> operator+(
+		const Rope<CharT, SynchronizationPrimative, Allocator>& lhs, 
+		const Rope<CharT, SynchronizationPrimative, Allocator>& rhs)
 	{
-		Rope<CharT, SynchronizationPrimative> result(lhs);
+		Rope<CharT, SynchronizationPrimative, Allocator> result(lhs);
 		result += rhs;
 		return result;
 	}
 
-	template< typename CharT, typename SynchronizationPrimative >
-	Rope<CharT, SynchronizationPrimative> operator+(
-		const Rope<CharT, SynchronizationPrimative>& lhs, 
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	Rope<CharT, SynchronizationPrimative, Allocator> operator+(
+		const Rope<CharT, SynchronizationPrimative, Allocator>& lhs, 
 		const CharT* rhs)
 	{
-		Rope<CharT, SynchronizationPrimative> result(lhs);
-		result += Rope<CharT, SynchronizationPrimative>(rhs);
+		Rope<CharT, SynchronizationPrimative, Allocator> result(lhs);
+		result += Rope<CharT, SynchronizationPrimative, Allocator>(rhs);
 		return result;
 	}
 
-	template< typename CharT, typename SynchronizationPrimative >
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
 	bool operator==(
-		const typename Rope<CharT, SynchronizationPrimative>::StringType& lhs, 
-		const Rope<CharT, SynchronizationPrimative>& rhs)
+		const typename Rope<CharT, SynchronizationPrimative, Allocator>::StringType& lhs, 
+		const Rope<CharT, SynchronizationPrimative, Allocator>& rhs)
 	{
 		return rhs==lhs;
 	}
 
-	template< typename CharT, typename SynchronizationPrimative >
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
 	bool operator==(
 		const CharT* lhs, 
-		const Rope<CharT, SynchronizationPrimative>& rhs)
+		const Rope<CharT, SynchronizationPrimative, Allocator>& rhs)
 	{
 		return rhs==lhs;
 	}
 
-	template<typename char_t, typename SynchronizationPrimative>
-	std::ostream& operator<<(
-		std::ostream& os, 
-		const WCRope::Rope<char_t, SynchronizationPrimative>& rhs)
+	// written straight to the stream's buffer, a span at a time.
+	// Unlike std::string's, width() and fill() are ignored (no padding), though width is reset
+	template< typename char_t, typename SynchronizationPrimative, typename Allocator >
+	std::basic_ostream<char_t>& operator<<(
+		std::basic_ostream<char_t>& os, 
+		const WCRope::Rope<char_t, SynchronizationPrimative, Allocator>& rhs)
 	{
-		typedef typename WCRope::Rope<char_t, SynchronizationPrimative>::const_iterator itr;
-		for (itr i = rhs.begin(); i!=rhs.end(); ++i)
-		{
-			os << *i;
-		}
+		typename std::basic_ostream<char_t>::sentry ok(os);
+		if (ok && !rhs.write_to( *os.rdbuf() ))
+			os.setstate( std::ios_base::badbit );
+		os.width(0);
 		return os;
 	}
 
-	template< typename CharT, typename SynchronizationPrimative >
-	class ReversableRope : public Rope<CharT, SynchronizationPrimative>
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator = Allocation::HeapAllocator >
+	class ReversableRope : public Rope<CharT, SynchronizationPrimative, Allocator>
 	{
 		public:
-			typedef Rope<CharT, SynchronizationPrimative> Base;
+			typedef Rope<CharT, SynchronizationPrimative, Allocator> Base;
 			// constructs a null/empty string
 			ReversableRope( )
 				: Base( )
@@ -988,7 +3823,7 @@ namespace WCRope
 			}
 
 			// constructs a copy of a string 
-			ReversableRope( const typename Rope<CharT, SynchronizationPrimative>::StringType& str )
+			ReversableRope( const typename Rope<CharT, SynchronizationPrimative, Allocator>::StringType& str )
 				: Base(str)
 			{				
 
@@ -1003,7 +3838,7 @@ namespace WCRope
 			}
 
 			// constructs a string of "count" repetitions of rhs
-			ReversableRope( size_t count, Rope<CharT, SynchronizationPrimative>& rhs )
+			ReversableRope( size_t count, Rope<CharT, SynchronizationPrimative, Allocator>& rhs )
 				: Base( count, rhs )
 			{
 				// nothing to do here
@@ -1023,7 +3858,7 @@ namespace WCRope
 				// nothing to do here
 			}
 
-			ReversableRope(const Rope<CharT, SynchronizationPrimative>& rhs)
+			ReversableRope(const Rope<CharT, SynchronizationPrimative, Allocator>& rhs)
 				: Base(rhs)
 			{
 				// nothing to do here
@@ -1032,24 +3867,28 @@ namespace WCRope
 			// create a reversed representation of this string
 			// a ref to the rev string is kept, and the reverse's reverse is referenced back to this, 
 			// so that repeated reverse ops don't create reduant objects, 
-			// and (reverse().reverse()==*this) is fast
+			// and (reverse().reverse()==*this) is fast.
+			// An inline string is promoted to a leaf once, and the leaf kept with the reverse, 
+			// so the reverse's reverse shares it and later calls (and rbegin/rend) don't allocate
 			ReversableRope reverse() const
 			{				
-				if (mRevRep.GetPtr()==0)
+				if (!IsReverseCurrent())
 				{
-					mRevRep = new SubStrRep<CharT, SynchronizationPrimative>(
-						this->size(), 0, this->mRopeRep
+					mForwardRep = this->Tree();
+					mRevRep = new SubStrRep<CharT, SynchronizationPrimative, Allocator>(
+						this->size(), 0, mForwardRep
 					);
 				}
 				ReversableRope result;
 				result.mRopeRep = mRevRep;
-				result.mRevRep = this->mRopeRep;
+				result.mRevRep = mForwardRep;
+				result.mForwardRep = mRevRep;
 				return result;
 			}
 
 			// reverse iteration is a bit of a hack...
-			typedef typename Rope<CharT, SynchronizationPrimative>::const_iterator const_reverse_iterator;
-			typedef typename Rope<CharT, SynchronizationPrimative>::const_iterator reverse_iterator;
+			typedef typename Rope<CharT, SynchronizationPrimative, Allocator>::const_iterator const_reverse_iterator;
+			typedef typename Rope<CharT, SynchronizationPrimative, Allocator>::const_iterator reverse_iterator;
 
 			const_reverse_iterator rbegin() const {
 				// creates a new rope that is the reverse of this one, then returns the begin() of that
@@ -1062,7 +3901,45 @@ namespace WCRope
 			}
 
 		private:
-			mutable typename Rope<CharT, SynchronizationPrimative>::Ptr mRevRep;
+			typedef typename Rope<CharT, SynchronizationPrimative, Allocator>::Ptr Ptr;
+
+			// whether mRevRep is the reverse of the string as it is now 
+			// (edits through Rope leave it as the reverse of what the string was)
+			bool IsReverseCurrent() const
+			{
+				if (!mRevRep)
+					return false;
+				if (this->mRopeRep)
+					return mForwardRep==this->mRopeRep;
+
+				if (mForwardRep->Length()!=this->mInlineLength)
+					return false;
+				CharT promoted[Base::InlineCapacity];
+				mForwardRep->Copy( 0, this->mInlineLength, promoted );
+				return std::char_traits<CharT>::compare( promoted, this->mInline, this->mInlineLength )==0;
+			}
+
+			// the reverse of this string, and the tree it is the reverse of 
+			// (the string's own tree, or the leaf an inline string was promoted to)
+			mutable Ptr mRevRep;
+			mutable Ptr mForwardRep;
+	};
+}
+
+namespace std
+{
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	struct hash< WCRope::Rope<CharT, SynchronizationPrimative, Allocator> >
+	{
+		size_t operator()(const WCRope::Rope<CharT, SynchronizationPrimative, Allocator>& rope) const {
+			return rope.hash();
+		}
+	};
+
+	template< typename CharT, typename SynchronizationPrimative, typename Allocator >
+	struct hash< WCRope::ReversableRope<CharT, SynchronizationPrimative, Allocator> >
+		: hash< WCRope::Rope<CharT, SynchronizationPrimative, Allocator> >
+	{
 	};
 }
 
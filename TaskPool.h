@@ -0,0 +1,228 @@
+#ifndef TASKPOOL_H_INCLUDED
+#define TASKPOOL_H_INCLUDED
+
+/*
+A work stealing thread pool for fork/join parallelism.
+
+Each worker has its own queue of tasks, it pushes and pops work at the back of its own queue
+(so recently split, cache warm, work is done first) and when that is empty steals from
+the front of the others' (taking the oldest, and so typically largest, pieces of work).
+
+Tasks are run as part of a TaskGroup, waiting on a group runs queued tasks rather than blocking,
+so tasks can themselves split work into further tasks of the same group and wait on it
+without tying up a worker, and a thread outside the pool that waits helps with the work.
+*/
+
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Tasks
+{
+	class TaskPool
+	{
+		public:
+			typedef std::function<void()> Task;
+
+			explicit TaskPool(size_t threads = DefaultThreads())
+				: mQueued(0)
+				, mNextQueue(0)
+				, mStop(false)
+			{
+				assert(threads>0);
+				for(size_t i=0;i!=threads;++i)
+					mQueues.push_back( std::unique_ptr<Queue>(new Queue()) );
+				for(size_t i=0;i!=threads;++i)
+					mThreads.push_back( std::thread( [this, i]() { Work(i); } ) );
+			}
+
+			~TaskPool()
+			{
+				{
+					std::lock_guard<std::mutex> lock(mSleepLock);
+					mStop = true;
+				}
+				mWake.notify_all();
+				for(size_t i=0;i!=mThreads.size();++i)
+					mThreads[i].join();
+			}
+
+			// a pool of one thread per core, created on first use.
+			// Never destroyed, its threads are left idle until the process exits
+			static TaskPool& Default()
+			{
+				static TaskPool* pool = new TaskPool();
+				return *pool;
+			}
+
+			size_t Size() const {
+				return mThreads.size();
+			}
+
+			// queues task, on the calling worker's own queue if it is one of this pool's
+			void Submit(Task task)
+			{
+				const size_t index = (CurrentPool()==this) ? CurrentIndex() : (mNextQueue++ % mQueues.size());
+				{
+					std::lock_guard<std::mutex> lock(mQueues[index]->mLock);
+					mQueues[index]->mTasks.push_back( std::move(task) );
+				}
+				mQueued.fetch_add(1, std::memory_order_release);
+
+				// taking the lock orders this with a worker checking mQueued before it sleeps
+				{
+					std::lock_guard<std::mutex> lock(mSleepLock);
+				}
+				mWake.notify_one();
+			}
+
+			// runs one queued task, if there is one, returns false if there wasn't
+			bool RunOne()
+			{
+				Task task;
+				if (!Take( (CurrentPool()==this) ? CurrentIndex() : 0, task ))
+					return false;
+				task();
+				return true;
+			}
+
+		private:
+			struct Queue
+			{
+				std::mutex mLock;
+				std::deque<Task> mTasks;
+			};
+
+			TaskPool(const TaskPool&);
+			TaskPool& operator=(const TaskPool&);
+
+			static size_t DefaultThreads()
+			{
+				const size_t cores = std::thread::hardware_concurrency();
+				return cores ? cores : 1;
+			}
+
+			void Work(size_t index)
+			{
+				CurrentPool() = this;
+				CurrentIndex() = index;
+				for(;;)
+				{
+					Task task;
+					if (Take(index, task))
+					{
+						task();
+						continue;
+					}
+
+					std::unique_lock<std::mutex> lock(mSleepLock);
+					if (mStop)
+						return;
+					if (mQueued.load(std::memory_order_acquire)==0)
+						mWake.wait(lock);
+				}
+			}
+
+			// the newest task on our own queue, or else the oldest from someone else's
+			bool Take(size_t index, Task& task)
+			{
+				if (mQueued.load(std::memory_order_acquire)==0)
+					return false;
+
+				for(size_t i=0;i!=mQueues.size();++i)
+				{
+					Queue& queue = *mQueues[(index+i) % mQueues.size()];
+					std::lock_guard<std::mutex> lock(queue.mLock);
+					if (!queue.mTasks.empty())
+					{
+						if (i==0)
+						{
+							task = std::move(queue.mTasks.back());
+							queue.mTasks.pop_back();
+						}
+						else
+						{
+							task = std::move(queue.mTasks.front());
+							queue.mTasks.pop_front();
+						}
+						mQueued.fetch_sub(1, std::memory_order_relaxed);
+						return true;
+					}
+				}
+				return false;
+			}
+
+			std::vector< std::unique_ptr<Queue> > mQueues;
+			std::vector< std::thread > mThreads;
+			std::atomic<size_t> mQueued;
+			std::atomic<size_t> mNextQueue;
+
+			std::mutex mSleepLock;
+			std::condition_variable mWake;
+			bool mStop;
+
+			// the pool (and queue) of the worker thread this is, if it is one
+			static TaskPool*& CurrentPool() {
+				static thread_local TaskPool* pool = 0;
+				return pool;
+			}
+
+			static size_t& CurrentIndex() {
+				static thread_local size_t index = 0;
+				return index;
+			}
+	};
+
+	// a set of tasks that can be waited on together
+	class TaskGroup
+	{
+		public:
+			explicit TaskGroup(TaskPool& pool = TaskPool::Default())
+				: mPool(pool)
+				, mPending(0)
+			{
+			}
+
+			// waits for anything still running, the tasks refer to the group
+			~TaskGroup()
+			{
+				Wait();
+			}
+
+			// may be called from any thread, including from within the group's tasks
+			void Run(std::function<void()> fn)
+			{
+				mPending.fetch_add(1, std::memory_order_relaxed);
+				mPool.Submit( [this, fn]() {
+					fn();
+					mPending.fetch_sub(1, std::memory_order_acq_rel);
+				} );
+			}
+
+			// runs queued tasks (not necessarily this group's) until all of this group's are done
+			void Wait()
+			{
+				while(mPending.load(std::memory_order_acquire)!=0)
+				{
+					if (!mPool.RunOne())
+						std::this_thread::yield();
+				}
+			}
+
+		private:
+			TaskGroup(const TaskGroup&);
+			TaskGroup& operator=(const TaskGroup&);
+
+			TaskPool& mPool;
+			std::atomic<size_t> mPending;
+	};
+}
+
+#endif
@@ -0,0 +1,786 @@
+#include "Rope.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// libstdc++'s SGI derived rope, compared against where it's available
+#if defined(__GLIBCXX__) && !defined(BENCH_NO_GNU_ROPE)
+#define BENCH_GNU_ROPE
+#include <ext/rope>
+#endif
+
+/*
+Usage: bench [options]
+	--suite=ops|policies   ops (the default) times string operations on Rope, std::string
+	                       and __gnu_cxx::rope at a range of sizes, policies compares Rope's
+	                       synchronisation, allocation and dispatch policies
+	--format=csv|json      csv (the default) is one line per result, after a header line
+	--min-size=N           smallest string, in characters, K/M/G suffixes allowed (default 1K)
+	--max-size=N           largest string (default 1G)
+	--step=N               each size is N times the last (default 32)
+	--only=NAME            only benchmarks whose name contains NAME
+	--impl=NAME            only the implementation NAME (rope, std_string, gnu_rope)
+	--min-time=S           seconds each result is measured for, at least (default 0.2)
+	--no-fork              runs every case in this process, by default each is run
+	                       in a child of its own, so peak_rss_kb is that case's alone
+
+Each ops result is a set of timed samples, each of a batch of operations, ns_p50..ns_max
+are percentiles of the per operation time of the samples. mb_per_s counts the characters
+each operation covers (the whole string for a find, one character for an index).
+Building the string operated on isn't timed, but does count towards peak_rss_kb.
+reverse produces a reversed copy, reverse_lazy (rope only) just the O(1) reversed view of it,
+so its mb_per_s is 0.
+*/
+
+namespace
+{
+	typedef std::chrono::steady_clock Clock;
+
+	double SecondsSince(Clock::time_point start)
+	{
+		return std::chrono::duration<double>(Clock::now() - start).count();
+	}
+
+	// xorshift, cheap enough not to swamp the operation being timed
+	size_t NextRandom(size_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+	// keeps results from being optimised away
+	volatile size_t gSink;
+
+	// ---- policies suite
+
+	// builds a rope of 'length' characters by appending short fragments
+	template< typename RopeT >
+	RopeT BuildRope(size_t length)
+	{
+		RopeT result;
+		size_t i = 0;
+		while(result.size() < length)
+		{
+			result += RopeT( typename RopeT::StringType(64, char('a' + i++ % 26)) );
+		}
+		return result;
+	}
+
+	// per Get() cost of random access to a rope shared by 'threads' readers
+	template< typename SynchronizationPrimative >
+	void BenchSharedGet(const char* policy, size_t threads)
+	{
+		typedef WCRope::Rope<char, SynchronizationPrimative> RopeT;
+		const size_t length = 1 << 20;
+		const size_t gets = 1 << 18;
+
+		const RopeT shared = BuildRope<RopeT>(length);
+
+		std::vector< std::thread > workers;
+		std::vector< size_t > sums(threads);
+		const Clock::time_point start = Clock::now();
+		for(size_t t=0;t!=threads;++t)
+		{
+			workers.push_back( std::thread( [&shared, &sums, t, gets]() {
+				size_t state = 0x9e3779b97f4a7c15ull + t;
+				size_t sum = 0;
+				for(size_t i=0;i!=gets;++i)
+					sum += shared[ NextRandom(state) % shared.size() ];
+				sums[t] = sum;
+			} ) );
+		}
+		for(size_t t=0;t!=threads;++t)
+			workers[t].join();
+		const double seconds = SecondsSince(start);
+
+		printf("shared_get,%s,%zu,%zu,%.1f\n",
+			policy, threads, shared.TreeDepth(), seconds * 1e9 / gets);
+	}
+
+	// node sizes and per concatenation cost of building a rope from many short fragments
+	template< typename SynchronizationPrimative, typename Allocator >
+	void BenchConcat(const char* policy, const char* allocator)
+	{
+		typedef WCRope::Rope<char, SynchronizationPrimative, Allocator> RopeT;
+		typedef WCRope::ConCatRep<char, SynchronizationPrimative, Allocator> ConCatT;
+		const size_t concats = 1 << 18;
+
+		// fresh leaves each time, so leaf allocation is part of the cost
+		const typename RopeT::StringType fragment(CHUNK_SIZE, 'x');
+		const Clock::time_point start = Clock::now();
+		{
+			RopeT result;
+			for(size_t i=0;i!=concats;++i)
+				result += RopeT(fragment);
+		}
+		const double seconds = SecondsSince(start);
+
+		printf("concat,%s,%s,%zu,%zu,%.1f\n",
+			policy, allocator, sizeof(typename RopeT::Ptr), sizeof(ConCatT), seconds * 1e9 / concats);
+	}
+
+	// random indexing and sequential iteration, the node dispatch hot paths
+	void BenchTraversal()
+	{
+		typedef WCRope::Rope<char, Synchronization::NullMutex> RopeT;
+#ifdef ROPE_TAGGED_DISPATCH
+		const char* dispatch = "tagged";
+#else
+		const char* dispatch = "virtual";
+#endif
+		const size_t length = 1 << 22;
+		const size_t gets = 1 << 20;
+		const RopeT rope = BuildRope<RopeT>(length);
+
+		size_t state = 0x9e3779b97f4a7c15ull;
+		size_t sum = 0;
+		Clock::time_point start = Clock::now();
+		for(size_t i=0;i!=gets;++i)
+			sum += rope[ NextRandom(state) % rope.size() ];
+		const double indexSeconds = SecondsSince(start);
+
+		start = Clock::now();
+		for(RopeT::const_iterator i=rope.begin(), e=rope.end();i!=e;++i)
+			sum += *i;
+		const double iterateSeconds = SecondsSince(start);
+
+		// sum keeps the loops from being optimised away
+		printf("index,%s,%zu,%.1f,%zu\n", dispatch, rope.TreeDepth(), indexSeconds * 1e9 / gets, sum & 1);
+		printf("iterate,%s,%zu,%.2f,%zu\n", dispatch, rope.TreeDepth(), iterateSeconds * 1e9 / rope.size(), sum & 1);
+	}
+
+	void RunPolicies()
+	{
+		printf("benchmark,policy,threads,depth,ns_per_get\n");
+
+		BenchSharedGet<Synchronization::NullMutex>("null", 1);
+
+		const size_t threadCounts[] = { 1, 4, 16 };
+		for(size_t i=0;i!=sizeof(threadCounts)/sizeof(threadCounts[0]);++i)
+		{
+			BenchSharedGet<Synchronization::Mutex>("mutex", threadCounts[i]);
+			BenchSharedGet<Synchronization::AtomicCount>("atomic", threadCounts[i]);
+		}
+
+		printf("benchmark,policy,allocator,ptr_bytes,concat_node_bytes,ns_per_concat\n");
+		BenchConcat<Synchronization::NullMutex, Allocation::HeapAllocator>("null", "heap");
+		BenchConcat<Synchronization::Mutex, Allocation::HeapAllocator>("mutex", "heap");
+		BenchConcat<Synchronization::AtomicCount, Allocation::HeapAllocator>("atomic", "heap");
+		BenchConcat<Synchronization::NullMutex, Allocation::PoolAllocator>("null", "pool");
+		BenchConcat<Synchronization::AtomicCount, Allocation::PoolAllocator>("atomic", "pool");
+
+		printf("benchmark,dispatch,depth,ns_per_char,checksum\n");
+		BenchTraversal();
+	}
+
+	// ---- ops suite
+
+	// the implementations compared, each adapts one string type to the operations timed
+	struct RopeImpl
+	{
+		typedef WCRope::Rope<char, Synchronization::NullMutex> String;
+
+		static const char* Name() { return "rope"; }
+		static bool CanReverse() { return true; }
+		static bool CanReverseLazily() { return true; }
+		static size_t MaxPrependSize() { return size_t(-1); }
+
+		static void AppendChar(String& s, char c) { s.push_back(c); }
+		static void Append(String& s, const char* data, size_t n) { s.append(data, n); }
+		static void Prepend(String& s, const char* data, size_t n) { s.insert(0, String(data, data+n)); }
+		static char At(const String& s, size_t i) { return s[i]; }
+		static size_t Find(const String& s, const char* needle) { return s.find(needle).GetIndex(); }
+		static int Compare(const String& a, const String& b) { return a.LexicographicalCompare3Way(b); }
+		static size_t Substr(const String& s, size_t pos, size_t n) { return s.substr(pos, n).size(); }
+		static size_t Flatten(const String& s) { return s.GetString().size(); }
+
+		// flattened, so the result is a reversed copy, as std::string's is
+		static size_t Reverse(const String& s)
+		{
+			const WCRope::ReversableRope<char, Synchronization::NullMutex> forward(s);
+			return forward.reverse().GetString().size();
+		}
+
+		// the reversed view alone, O(1), nothing is copied
+		static size_t ReverseLazy(const String& s)
+		{
+			const WCRope::ReversableRope<char, Synchronization::NullMutex> forward(s);
+			return forward.reverse().size();
+		}
+
+		static size_t Depth(const String& s) { return s.TreeDepth(); }
+	};
+
+	struct StdStringImpl
+	{
+		typedef std::string String;
+
+		static const char* Name() { return "std_string"; }
+		static bool CanReverse() { return true; }
+		static bool CanReverseLazily() { return false; }
+		// each prepend moves the whole string, building by prepending is quadratic
+		static size_t MaxPrependSize() { return 1 << 20; }
+
+		static void AppendChar(String& s, char c) { s.push_back(c); }
+		static void Append(String& s, const char* data, size_t n) { s.append(data, n); }
+		static void Prepend(String& s, const char* data, size_t n) { s.insert(0, data, n); }
+		static char At(const String& s, size_t i) { return s[i]; }
+		static size_t Find(const String& s, const char* needle) { return std::min(s.find(needle), s.size()); }
+		static int Compare(const String& a, const String& b) { return a.compare(b); }
+		static size_t Substr(const String& s, size_t pos, size_t n) { return s.substr(pos, n).size(); }
+		static size_t Flatten(const String& s) { return String(s).size(); }
+		static size_t Reverse(const String& s) { return String(s.rbegin(), s.rend()).size(); }
+		static size_t ReverseLazy(const String& s) { return s.size(); }
+		static size_t Depth(const String&) { return 0; }
+	};
+
+#ifdef BENCH_GNU_ROPE
+	struct GnuRopeImpl
+	{
+		typedef __gnu_cxx::crope String;
+
+		static const char* Name() { return "gnu_rope"; }
+		static bool CanReverse() { return false; }
+		static bool CanReverseLazily() { return false; }
+		static size_t MaxPrependSize() { return size_t(-1); }
+
+		static void AppendChar(String& s, char c) { s.push_back(c); }
+		static void Append(String& s, const char* data, size_t n) { s.append(data, n); }
+		static void Prepend(String& s, const char* data, size_t n) { s.insert(0, data, n); }
+		static char At(const String& s, size_t i) { return s[i]; }
+		static size_t Find(const String& s, const char* needle) { return std::min<size_t>(s.find(needle), s.size()); }
+		static int Compare(const String& a, const String& b) { return a.compare(b); }
+		static size_t Substr(const String& s, size_t pos, size_t n) { return s.substr(pos, n).size(); }
+
+		static size_t Flatten(const String& s)
+		{
+			std::string result(s.size(), '\0');
+			if (!result.empty())
+				s.copy(0, s.size(), &result[0]);
+			return result.size();
+		}
+
+		static size_t Reverse(const String& s) { return s.size(); }
+		static size_t ReverseLazy(const String& s) { return s.size(); }
+		static size_t Depth(const String&) { return 0; }
+	};
+#endif
+
+	struct Options
+	{
+		Options()
+			: mJson(false)
+			, mMinSize(1 << 10)
+			, mMaxSize(size_t(1) << 30)
+			, mStep(32)
+			, mMinTime(0.2)
+			, mFork(true)
+		{
+		}
+
+		bool mJson;
+		size_t mMinSize, mMaxSize, mStep;
+		std::string mOnly, mImpl;
+		double mMinTime;
+		bool mFork;
+	};
+
+	// plain old data, so a child can hand it back through a pipe
+	struct Result
+	{
+		char mBenchmark[32];
+		char mImpl[32];
+		size_t mSize;
+		size_t mOps;
+		size_t mDepth;
+		double mSeconds;
+		double mPercentiles[4];
+		double mBytesPerOp;
+		long mPeakRssKb;
+	};
+
+	// timed samples of one case, each the per operation time of a batch
+	class Samples
+	{
+		public:
+			Samples()
+				: mOps(0)
+				, mSeconds(0)
+			{
+			}
+
+			// times fn(), a batch of ops operations
+			template< typename Fn >
+			void Time(size_t ops, Fn fn)
+			{
+				const Clock::time_point start = Clock::now();
+				fn();
+				Add(ops, SecondsSince(start));
+			}
+
+			void Add(size_t ops, double seconds)
+			{
+				mSamples.push_back(seconds*1e9/ops);
+				mOps += ops;
+				mSeconds += seconds;
+			}
+
+			// whether to keep going, at least minSamples, for at least minTime
+			bool More(const Options& options, size_t minSamples = 3) const {
+				return mSamples.size()<minSamples || mSeconds<options.mMinTime;
+			}
+
+			void Fill(Result& result)
+			{
+				result.mOps = mOps;
+				result.mSeconds = mSeconds;
+				std::sort(mSamples.begin(), mSamples.end());
+				const double percentiles[4] = { 0.5, 0.9, 0.99, 1.0 };
+				for(size_t i=0;i!=4;++i)
+				{
+					// nearest rank
+					const size_t rank = static_cast<size_t>( percentiles[i]*mSamples.size() + 0.999999 );
+					result.mPercentiles[i] = mSamples.empty() ? 0 : mSamples[ std::max<size_t>(rank, 1)-1 ];
+				}
+			}
+
+		private:
+			std::vector<double> mSamples;
+			size_t mOps;
+			double mSeconds;
+	};
+
+	// content for the strings, lower case letters so the (upper case) needle never matches
+	class Chunks
+	{
+		public:
+			enum { Size = 64 };
+
+			Chunks()
+				: mState(0x9e3779b97f4a7c15ull)
+			{
+			}
+
+			const char* Next()
+			{
+				for(size_t i=0;i!=Size;++i)
+					mChunk[i] = char('a' + NextRandom(mState) % 26);
+				return mChunk;
+			}
+
+		private:
+			size_t mState;
+			char mChunk[Size];
+	};
+
+	const char* const gNeedle = "NEEDLE";
+
+	template< typename Impl >
+	typename Impl::String BuildString(size_t size)
+	{
+		typename Impl::String result;
+		Chunks chunks;
+		for(size_t n=0;n<size;n+=Chunks::Size)
+			Impl::Append( result, chunks.Next(), std::min<size_t>(Chunks::Size, size-n) );
+		return result;
+	}
+
+	// runs benchmark on Impl at size, false if it doesn't apply
+	template< typename Impl >
+	bool RunCase(const std::string& benchmark, size_t size, const Options& options, Result& result)
+	{
+		typedef typename Impl::String String;
+		Samples samples;
+		size_t sum = 0;
+		size_t depth = 0;
+		double bytesPerOp = 1;
+
+		if (benchmark=="append_char")
+		{
+			const size_t batch = std::min<size_t>(size, 4096);
+			do
+			{
+				String s;
+				Chunks chunks;
+				for(size_t n=0;n<size;n+=batch)
+				{
+					const char* chunk = chunks.Next();
+					const size_t m = std::min(batch, size-n);
+					samples.Time( m, [&]() {
+						for(size_t i=0;i!=m;++i)
+							Impl::AppendChar( s, chunk[i % Chunks::Size] );
+					});
+				}
+				depth = Impl::Depth(s);
+			} while(samples.More(options, 1));
+		}
+		else if (benchmark=="append_chunk" || benchmark=="prepend")
+		{
+			const bool prepend = benchmark=="prepend";
+			if (prepend && size>Impl::MaxPrependSize())
+				return false;
+			const size_t batch = 64;
+			bytesPerOp = Chunks::Size;
+			do
+			{
+				String s;
+				Chunks chunks;
+				for(size_t n=0;n<size;)
+				{
+					size_t ops = 0;
+					const Clock::time_point start = Clock::now();
+					for(;ops!=batch && n<size;++ops, n+=Chunks::Size)
+					{
+						if (prepend)
+							Impl::Prepend( s, chunks.Next(), Chunks::Size );
+						else
+							Impl::Append( s, chunks.Next(), Chunks::Size );
+					}
+					samples.Add( ops, SecondsSince(start) );
+				}
+				depth = Impl::Depth(s);
+			} while(samples.More(options, 1));
+		}
+		else if (benchmark=="index")
+		{
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			const size_t batch = 1024;
+			size_t state = 0x9e3779b97f4a7c15ull;
+			do
+			{
+				samples.Time( batch, [&]() {
+					for(size_t i=0;i!=batch;++i)
+						sum += Impl::At( s, NextRandom(state) % size );
+				});
+			} while(samples.More(options, 64));
+		}
+		else if (benchmark=="iterate")
+		{
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			const size_t sampleSize = std::min<size_t>(size, 1 << 16);
+			do
+			{
+				// timed in samples of sampleSize characters, as a whole pass may be seconds long
+				Clock::time_point start = Clock::now();
+				size_t n = 0;
+				for(typename String::const_iterator i=s.begin(), e=s.end();i!=e;++i)
+				{
+					sum += *i;
+					if (++n==sampleSize)
+					{
+						samples.Add( n, SecondsSince(start) );
+						n = 0;
+						start = Clock::now();
+					}
+				}
+			} while(samples.More(options));
+		}
+		else if (benchmark=="find")
+		{
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			bytesPerOp = double(size);
+			do
+			{
+				samples.Time( 1, [&]() { sum += Impl::Find(s, gNeedle); } );
+			} while(samples.More(options));
+		}
+		else if (benchmark=="compare")
+		{
+			// equal, but built separately, so nothing is shared
+			const String lhs = BuildString<Impl>(size);
+			const String rhs = BuildString<Impl>(size);
+			depth = Impl::Depth(lhs);
+			bytesPerOp = double(size);
+			do
+			{
+				samples.Time( 1, [&]() { sum += Impl::Compare(lhs, rhs); } );
+			} while(samples.More(options));
+		}
+		else if (benchmark=="substr")
+		{
+			// a random half of the string
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			bytesPerOp = double(size/2);
+			size_t state = 0x9e3779b97f4a7c15ull;
+			do
+			{
+				const size_t pos = NextRandom(state) % (size-size/2+1);
+				samples.Time( 1, [&]() { sum += Impl::Substr(s, pos, size/2); } );
+			} while(samples.More(options));
+		}
+		else if (benchmark=="get_string")
+		{
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			bytesPerOp = double(size);
+			do
+			{
+				samples.Time( 1, [&]() { sum += Impl::Flatten(s); } );
+			} while(samples.More(options));
+		}
+		else if (benchmark=="reverse" || benchmark=="reverse_lazy")
+		{
+			const bool lazy = benchmark=="reverse_lazy";
+			if (lazy ? !Impl::CanReverseLazily() : !Impl::CanReverse())
+				return false;
+			const String s = BuildString<Impl>(size);
+			depth = Impl::Depth(s);
+			// a lazy reverse doesn't touch the characters
+			bytesPerOp = lazy ? 0 : double(size);
+			do
+			{
+				samples.Time( 1, [&]() { sum += lazy ? Impl::ReverseLazy(s) : Impl::Reverse(s); } );
+			} while(samples.More(options));
+		}
+		else
+		{
+			return false;
+		}
+
+		gSink = sum;
+		samples.Fill(result);
+		result.mDepth = depth;
+		result.mBytesPerOp = bytesPerOp;
+		return true;
+	}
+
+	long PeakRssKb()
+	{
+#ifdef WIN32
+		return 0;
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage)!=0)
+			return 0;
+#ifdef __APPLE__
+		return usage.ru_maxrss / 1024;
+#else
+		return usage.ru_maxrss;
+#endif
+#endif
+	}
+
+	typedef bool (*CaseFn)(const std::string&, size_t, const Options&, Result&);
+
+	struct Implementation
+	{
+		const char* mName;
+		CaseFn mRun;
+	};
+
+	// runs the case, in a child process unless told not to, so its memory use is its own
+	bool RunIsolated(const Implementation& impl, const std::string& benchmark, size_t size, const Options& options, Result& result)
+	{
+		memset(&result, 0, sizeof(result));
+		strncpy(result.mBenchmark, benchmark.c_str(), sizeof(result.mBenchmark)-1);
+		strncpy(result.mImpl, impl.mName, sizeof(result.mImpl)-1);
+		result.mSize = size;
+
+#ifndef WIN32
+		if (options.mFork)
+		{
+			int fds[2];
+			if (pipe(fds)!=0)
+				return false;
+			fflush(stdout);
+			const pid_t child = fork();
+			if (child==0)
+			{
+				close(fds[0]);
+				const bool ran = impl.mRun(benchmark, size, options, result);
+				result.mPeakRssKb = PeakRssKb();
+				if (ran && write(fds[1], &result, sizeof(result))!=static_cast<ssize_t>(sizeof(result)))
+					_exit(1);
+				_exit(0);
+			}
+			close(fds[1]);
+
+			bool ran = false;
+			if (child>0)
+			{
+				ran = read(fds[0], &result, sizeof(result))==static_cast<ssize_t>(sizeof(result));
+				int status = 0;
+				waitpid(child, &status, 0);
+				if (!WIFEXITED(status) || WEXITSTATUS(status)!=0)
+				{
+					fprintf(stderr, "%s/%s/%zu failed (out of memory?)\n", impl.mName, benchmark.c_str(), size);
+					ran = false;
+				}
+			}
+			close(fds[0]);
+			return ran;
+		}
+#endif
+		const bool ran = impl.mRun(benchmark, size, options, result);
+		result.mPeakRssKb = PeakRssKb();
+		return ran;
+	}
+
+	void PrintResult(const Result& result, const Options& options, bool first)
+	{
+		const double opsPerSecond = result.mSeconds>0 ? result.mOps/result.mSeconds : 0;
+		const double mbPerSecond = opsPerSecond*result.mBytesPerOp/1e6;
+		if (options.mJson)
+		{
+			printf("%s\n  {\"benchmark\": \"%s\", \"impl\": \"%s\", \"size\": %zu, \"ops\": %zu, \"seconds\": %.6f, "
+				"\"ns_p50\": %.1f, \"ns_p90\": %.1f, \"ns_p99\": %.1f, \"ns_max\": %.1f, "
+				"\"ops_per_s\": %.1f, \"mb_per_s\": %.2f, \"depth\": %zu, \"peak_rss_kb\": %ld}",
+				first ? "" : ",",
+				result.mBenchmark, result.mImpl, result.mSize, result.mOps, result.mSeconds,
+				result.mPercentiles[0], result.mPercentiles[1], result.mPercentiles[2], result.mPercentiles[3],
+				opsPerSecond, mbPerSecond, result.mDepth, result.mPeakRssKb);
+		}
+		else
+		{
+			printf("%s,%s,%zu,%zu,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f,%zu,%ld\n",
+				result.mBenchmark, result.mImpl, result.mSize, result.mOps, result.mSeconds,
+				result.mPercentiles[0], result.mPercentiles[1], result.mPercentiles[2], result.mPercentiles[3],
+				opsPerSecond, mbPerSecond, result.mDepth, result.mPeakRssKb);
+		}
+		fflush(stdout);
+	}
+
+	void RunOps(const Options& options)
+	{
+		const char* const benchmarks[] = {
+			"append_char", "append_chunk", "prepend", "index", "iterate",
+			"find", "compare", "substr", "get_string", "reverse", "reverse_lazy"
+		};
+		const Implementation impls[] = {
+			{ RopeImpl::Name(), &RunCase<RopeImpl> },
+			{ StdStringImpl::Name(), &RunCase<StdStringImpl> },
+#ifdef BENCH_GNU_ROPE
+			{ GnuRopeImpl::Name(), &RunCase<GnuRopeImpl> },
+#endif
+		};
+
+		if (options.mJson)
+			printf("[");
+		else
+			printf("benchmark,impl,size,ops,seconds,ns_p50,ns_p90,ns_p99,ns_max,ops_per_s,mb_per_s,depth,peak_rss_kb\n");
+
+		bool first = true;
+		for(size_t b=0;b!=sizeof(benchmarks)/sizeof(benchmarks[0]);++b)
+		{
+			if (std::string(benchmarks[b]).find(options.mOnly)==std::string::npos)
+				continue;
+			for(size_t size=options.mMinSize;size<=options.mMaxSize;size*=options.mStep)
+			{
+				for(size_t i=0;i!=sizeof(impls)/sizeof(impls[0]);++i)
+				{
+					if (!options.mImpl.empty() && options.mImpl!=impls[i].mName)
+						continue;
+					Result result;
+					if (RunIsolated(impls[i], benchmarks[b], size, options, result))
+					{
+						PrintResult(result, options, first);
+						first = false;
+					}
+				}
+				if (size > options.mMaxSize/options.mStep)
+					break;
+			}
+		}
+
+		if (options.mJson)
+			printf("\n]\n");
+	}
+
+	// a count of characters, with an optional K, M or G (binary) suffix
+	bool ParseSize(const char* text, size_t& size)
+	{
+		char* end;
+		const unsigned long long value = strtoull(text, &end, 10);
+		size_t scale = 1;
+		switch(*end)
+		{
+			case 'k': case 'K': scale = size_t(1) << 10; ++end; break;
+			case 'm': case 'M': scale = size_t(1) << 20; ++end; break;
+			case 'g': case 'G': scale = size_t(1) << 30; ++end; break;
+		}
+		size = static_cast<size_t>(value)*scale;
+		return end!=text && *end=='\0';
+	}
+
+	bool Matches(const char* arg, const char* name, const char*& value)
+	{
+		const size_t length = strlen(name);
+		if (strncmp(arg, name, length)!=0)
+			return false;
+		value = arg+length;
+		return true;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	std::string suite = "ops";
+	for(int i=1;i<argc;++i)
+	{
+		const char* value;
+		bool ok = true;
+		if (Matches(argv[i], "--suite=", value))
+			suite = value;
+		else if (Matches(argv[i], "--format=", value))
+		{
+			options.mJson = strcmp(value, "json")==0;
+			ok = options.mJson || strcmp(value, "csv")==0;
+		}
+		else if (Matches(argv[i], "--min-size=", value))
+			ok = ParseSize(value, options.mMinSize) && options.mMinSize>0;
+		else if (Matches(argv[i], "--max-size=", value))
+			ok = ParseSize(value, options.mMaxSize);
+		else if (Matches(argv[i], "--step=", value))
+			ok = ParseSize(value, options.mStep) && options.mStep>1;
+		else if (Matches(argv[i], "--only=", value))
+			options.mOnly = value;
+		else if (Matches(argv[i], "--impl=", value))
+			options.mImpl = value;
+		else if (Matches(argv[i], "--min-time=", value))
+			options.mMinTime = atof(value);
+		else if (strcmp(argv[i], "--no-fork")==0)
+			options.mFork = false;
+		else
+			ok = false;
+
+		if (!ok)
+		{
+			fprintf(stderr, "bad argument %s, see the top of bench.cpp for usage\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (suite=="policies")
+	{
+		RunPolicies();
+	}
+	else if (suite=="ops")
+	{
+		RunOps(options);
+	}
+	else
+	{
+		fprintf(stderr, "unknown suite %s\n", suite.c_str());
+		return 1;
+	}
+	return 0;
+}
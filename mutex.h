@@ -91,6 +91,18 @@ namespace Synchronization
 			NullMutex& operator=(const NullMutex&);
 	};
 
+	// not a mutex - selects lock free (std::atomic) reference counting 
+	// when used as the synchronization policy of a TRefCounter
+	class AtomicCount
+	{
+		public:
+			AtomicCount() { }
+			~AtomicCount() { }
+		private:
+			AtomicCount(const AtomicCount&);
+			AtomicCount& operator=(const AtomicCount&);
+	};
+
 	template< typename MutexType >
 	class TMutexLock
 	{
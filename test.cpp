@@ -1,12 +1,644 @@
 #include "Rope.h"
+#include "ConcurrentRope.h"
+
+#include <stdlib.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef WCRope::Rope<char, Synchronization::NullMutex> TestRope;
+typedef WCRope::ReversableRope<char, Synchronization::NullMutex> TestReversableRope;
+
+// exposes the tree, to walk ranges of it directly, or build it by hand
+template< typename RopeT >
+class TreeAccess : public RopeT
+{
+	public:
+		TreeAccess()
+		{
+		}
+
+		explicit TreeAccess(const RopeT& rope)
+			: RopeT(rope)
+		{
+		}
+
+		using RopeT::Tree;
+		using RopeT::SetTree;
+};
+
+typedef TreeAccess<TestRope> TreeRope;
+
+// reverse traversal of trees at least three levels deep, over ranges starting left of a right subtree
+// (it used to skip the left siblings, and so rfind missed matches)
+bool TestReverseTraversal()
+{
+	TestRope rope;
+	std::string expected;
+	for(size_t i=0;i!=40;++i)
+	{
+		const std::string leaf(CHUNK_SIZE+1+i%7, char('a'+i%26));
+		rope += TestRope(leaf + "|");
+		expected += leaf + "|";
+	}
+	if (rope.TreeDepth()<3)
+		return false;
+
+	const TreeRope tree(rope);
+	for(size_t pos=0;pos<expected.size();pos+=13)
+	{
+		for(size_t len=0;pos+len<=expected.size();len+=29)
+		{
+			std::string visited;
+			tree.Tree()->ForEachChunkReverse(pos, len, [&visited](const char* data, size_t n) -> bool {
+				visited.insert(visited.begin(), data, data+n);
+				return true;
+			});
+			if (visited!=expected.substr(pos, len))
+			{
+				printf("ForEachChunkReverse(%zu, %zu) visited the wrong characters\n", pos, len);
+				return false;
+			}
+		}
+	}
+
+	const char* needles[] = { "a", "|", "aaaa|", "|bbbb", "z|", "|a", "q" };
+	for(size_t i=0;i!=sizeof(needles)/sizeof(needles[0]);++i)
+	{
+		const size_t found = rope.rfind(needles[i]).GetIndex();
+		const size_t wanted = std::min(expected.rfind(needles[i]), expected.size());
+		if (found!=wanted)
+		{
+			printf("rfind(\"%s\") found %zu, not %zu\n", needles[i], found, wanted);
+			return false;
+		}
+	}
+	if (rope.rfind('a').GetIndex()!=expected.rfind('a'))
+	{
+		printf("rfind('a') found the wrong match\n");
+		return false;
+	}
+	return true;
+}
+
+// the same characters as expected, by each of the ways of reading them out
+bool Matches(const TestRope& rope, const std::string& expected, const char* what)
+{
+	if (rope.size()==expected.size() && rope==expected && rope.GetString()==expected && 
+		std::string(rope.begin(), rope.end())==expected)
+		return true;
+	printf("%s gave the wrong string\n", what);
+	return false;
+}
+
+// a tree at least three levels deep, of leaves longer than CHUNK_SIZE
+TestRope DeepRope(std::string& expected)
+{
+	TestRope rope;
+	expected.clear();
+	for(size_t i=0;i!=40;++i)
+	{
+		const std::string leaf(CHUNK_SIZE+1+i%7, char('a'+i%26));
+		rope += TestRope(leaf);
+		expected += leaf;
+	}
+	return rope;
+}
+
+// a random string, of one of the kinds of leaf slices are taken of
+class Pieces
+{
+	public:
+		explicit Pieces(const TestRope& mapped, const std::string& mappedExpected)
+			: mMapped(mapped)
+			, mMappedExpected(mappedExpected)
+		{
+		}
+
+		TestRope Next(const TestRope& rope, const std::string& expected, std::string& piece)
+		{
+			const size_t length = rand()%4==0 ? rand()%500 : rand()%(2*CHUNK_SIZE);
+			switch(rand()%5)
+			{
+				case 0:
+				{
+					piece = Random(length);
+					return TestRope(piece);
+				}
+				case 1:
+				{
+					const size_t start = rand()%(mMappedExpected.size()-length);
+					piece = mMappedExpected.substr(start, length);
+					return mMapped.substr(start, length);
+				}
+				case 2:
+				{
+					piece = std::string(length, char('A'+rand()%26));
+					return TestRope(length, piece.empty() ? 'A' : piece[0]);
+				}
+				case 3:
+				{
+					// sliced out of the middle of a reversed tree
+					std::string forward = Random(length+2*CHUNK_SIZE);
+					const TestReversableRope reversed = TestReversableRope( TestRope(forward) ).reverse();
+					piece = std::string(forward.rbegin(), forward.rend()).substr(CHUNK_SIZE, length);
+					return reversed.substr(CHUNK_SIZE, length);
+				}
+				default:
+				{
+					const size_t start = rand()%(expected.size()+1);
+					piece = expected.substr(start, length);
+					return rope.substr(start, length);
+				}
+			}
+		}
+
+	private:
+		static std::string Random(size_t length)
+		{
+			std::string result(length, ' ');
+			for(size_t i=0;i!=length;++i)
+				result[i] = char('a'+rand()%26);
+			return result;
+		}
+
+		const TestRope& mMapped;
+		const std::string& mMappedExpected;
+};
+
+// split, insert, erase, replace and substr against std::string, over a deep tree of 
+// plain, mapped, fill, reversed and shared leaves (and slices of them).
+// A copy taken before each edit mustn't see it
+bool TestEdits()
+{
+	const char* path = "test_edits.tmp";
+	std::string mappedExpected;
+	for(size_t i=0;mappedExpected.size()<2*MAPPED_LEAF_SIZE;++i)
+		mappedExpected += "mapped " + std::to_string(i) + "\n";
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	fwrite(mappedExpected.data(), 1, mappedExpected.size(), file);
+	fclose(file);
+
+	bool result = true;
+	{
+		const TestRope mapped = TestRope::open_file(path);
+		Pieces pieces(mapped, mappedExpected);
+
+		// slices long enough to share the mapped leaves, and slices of them
+		for(size_t i=0;result && i!=50;++i)
+		{
+			const size_t start = rand()%(mappedExpected.size()/2);
+			const size_t len = MAPPED_LEAF_SIZE/4 + rand()%MAPPED_LEAF_SIZE;
+			const TestRope slice = mapped.substr(start, len);
+			const size_t inner = rand()%(len/2);
+			result = Matches(slice, mappedExpected.substr(start, len), "substr of a mapped file") && 
+				Matches(slice.substr(inner, len/2), mappedExpected.substr(start+inner, len/2), "substr of a mapped substr");
+		}
+
+		std::string expected;
+		TestRope rope = DeepRope(expected);
+		if (rope.TreeDepth()<3)
+			result = false;
+
+		for(size_t i=0;result && i!=3000;++i)
+		{
+			const TestRope before = rope;
+			const std::string beforeExpected = expected;
+
+			std::string piece;
+			const TestRope inserted = pieces.Next(rope, expected, piece);
+			result = Matches(inserted, piece, "a slice");
+
+			const size_t pos = rand()%(expected.size()+1);
+			const size_t len = rand()%4==0 ? rand()%1000 : rand()%(2*CHUNK_SIZE);
+			switch(rand()%6)
+			{
+				case 0:
+					rope.insert(pos, inserted);
+					expected.insert(pos, piece);
+					result = result && Matches(rope, expected, "insert");
+					break;
+				case 1:
+					// only shrinks big strings, so the tree stays deep
+					if (expected.size()>4000)
+					{
+						rope.erase(pos, len);
+						expected.erase(pos, len);
+					}
+					result = result && Matches(rope, expected, "erase");
+					break;
+				case 2:
+					rope.replace(pos, len, inserted);
+					expected.replace(pos, len, piece);
+					result = result && Matches(rope, expected, "replace");
+					break;
+				case 3:
+				{
+					const std::pair< TestRope, TestRope > halves = rope.split(pos);
+					result = result && Matches(halves.first, expected.substr(0, pos), "split (first)") &&
+						Matches(halves.second, expected.substr(pos), "split (second)");
+					rope = halves.second + halves.first;
+					expected = expected.substr(pos) + expected.substr(0, pos);
+					result = result && Matches(rope, expected, "concatenating split halves");
+					break;
+				}
+				case 4:
+				{
+					// appended to in place, if it's a copy of a leaf slice
+					TestRope slice = rope.substr(pos, len);
+					std::string sliceExpected = expected.substr(pos, len);
+					slice.append(piece.data(), piece.size());
+					slice.push_back('!');
+					sliceExpected += piece + "!";
+					result = result && Matches(slice, sliceExpected, "appending to a substr");
+					break;
+				}
+				default:
+					rope += inserted;
+					expected += piece;
+					for(size_t c=0;c!=len%8;++c)
+					{
+						rope.push_back(char('0'+c));
+						expected += char('0'+c);
+					}
+					result = result && Matches(rope, expected, "append");
+					break;
+			}
+			result = result && Matches(before, beforeExpected, "an edit of a copy");
+			if (!result)
+				printf("at edit %zu, position %zu, length %zu\n", i, pos, len);
+		}
+		if (result && rope.TreeDepth()<3)
+		{
+			printf("edits left a tree %zu deep\n", rope.TreeDepth());
+			result = false;
+		}
+	}
+	remove(path);
+	return result;
+}
+
+// appending in place to the rightmost leaf, only when the whole right spine is this rope's own
+bool TestAppendInPlace()
+{
+	std::string expected;
+	TestRope rope = DeepRope(expected);
+	for(size_t i=0;i!=2000;++i)
+	{
+		rope.push_back(char('a'+i%26));
+		expected += char('a'+i%26);
+	}
+	if (!Matches(rope, expected, "push_back"))
+		return false;
+
+	// the spine shared with a copy
+	const TestRope copy = rope;
+	const std::string copyExpected = expected;
+	rope.append("appended", 8);
+	expected += "appended";
+	if (!Matches(rope, expected, "appending to a shared rope") || !Matches(copy, copyExpected, "a copy appended to"))
+		return false;
+
+	// the rightmost subtree shared with a rope it was concatenated on to
+	TestRope prefixed = TestRope( std::string(2*CHUNK_SIZE, 'p') ) + copy;
+	const std::string prefixedExpected = std::string(2*CHUNK_SIZE, 'p') + copyExpected;
+	if (!Matches(prefixed, prefixedExpected, "concatenation"))
+		return false;
+	for(size_t i=0;i!=100;++i)
+		prefixed.push_back('q');
+	if (!Matches(prefixed, prefixedExpected + std::string(100, 'q'), "appending to a shared subtree") || 
+		!Matches(copy, copyExpected, "a subtree appended to"))
+		return false;
+
+	// unique again once the copies are gone
+	TestRope unique = copy;
+	for(size_t i=0;i!=100;++i)
+		unique.push_back('u');
+	return Matches(unique, copyExpected + std::string(100, 'u'), "appending to a unique rope") && 
+		Matches(copy, copyExpected, "a copy appended to");
+}
+
+// strings held in the handle, and promoted to (or taken out of) a tree as they grow and shrink
+bool TestInline()
+{
+	TestRope rope;
+	std::string expected;
+	for(size_t i=0;i!=3*CHUNK_SIZE;++i)
+	{
+		const TestRope before = rope;
+		const std::string beforeExpected = expected;
+		rope.push_back(char('a'+i%26));
+		expected += char('a'+i%26);
+		if (!Matches(rope, expected, "push_back") || !Matches(before, beforeExpected, "a copy pushed on to"))
+			return false;
+	}
+	while(!expected.empty())
+	{
+		const size_t pos = expected.size()/3;
+		rope.erase(pos, 3);
+		expected.erase(pos, 3);
+		if (!Matches(rope, expected, "erase"))
+			return false;
+	}
+
+	std::string deepExpected;
+	const TestRope deep = DeepRope(deepExpected);
+	for(size_t len=0;len!=2*CHUNK_SIZE;++len)
+	{
+		TestRope slice = deep.substr(deepExpected.size()/2, len);
+		std::string sliceExpected = deepExpected.substr(deepExpected.size()/2, len);
+		if (!Matches(slice, sliceExpected, "substr of a tree"))
+			return false;
+		slice.insert(len/2, TestRope("inserted"));
+		sliceExpected.insert(len/2, "inserted");
+		if (!Matches(slice, sliceExpected, "insert into a substr"))
+			return false;
+		slice += deep;
+		sliceExpected += deepExpected;
+		if (!Matches(slice, sliceExpected, "concatenating a tree on to a substr"))
+			return false;
+	}
+
+	const TestReversableRope shortRope("short");
+	const TestReversableRope reversed = shortRope.reverse();
+	if (!Matches(reversed, "trohs", "reverse of an inline string") || !Matches(reversed.reverse(), "short", "reverse of a reverse"))
+		return false;
+	return std::string(shortRope.rbegin(), shortRope.rend())=="trohs";
+}
+
+typedef WCRope::ConcurrentRope<char> SharedRope;
+
+// each version of the concurrent rope is a run of blocks, [first, last), each its index and then filler.
+// Checks the version is such a run, with last no lower than the last version seen, and updates it
+bool ConsistentVersion(const SharedRope::RopeType& rope, size_t& last)
+{
+	const size_t blockSize = 8+2*CHUNK_SIZE;
+	const std::string contents = rope.GetString();
+	if (contents.size()%blockSize || rope.size()!=contents.size())
+		return false;
+
+	size_t index = 0;
+	for(size_t pos=0;pos!=contents.size();pos+=blockSize)
+	{
+		const size_t block = strtoul(contents.substr(pos, 8).c_str(), 0, 10);
+		if ((pos && block!=index+1) || contents.compare(pos+8, blockSize-8, std::string(blockSize-8, char('a'+block%26))))
+			return false;
+		index = block;
+	}
+	if (contents.size() && index+1<last)
+		return false;
+	last = contents.size() ? index+1 : last;
+	return true;
+}
+
+// a writer updating the rope many more times than versions are retired in a batch (32), 
+// appending blocks and erasing the oldest, while readers check each version they see 
+// through a View, a snapshot, and a copy taken from a View that outlives it
+bool TestConcurrentRope()
+{
+	SharedRope shared;
+	std::atomic<bool> done(false);
+	std::atomic<size_t> failures(0);
+
+	std::vector< std::thread > readers;
+	for(size_t t=0;t!=3;++t)
+	{
+		readers.push_back( std::thread( [&shared, &done, &failures]() {
+			size_t last = 0;
+			SharedRope::RopeType held;
+			std::string heldExpected;
+			while(!done.load())
+			{
+				SharedRope::RopeType copy;
+				{
+					const SharedRope::View view(shared);
+					if (!ConsistentVersion(view.rope(), last))
+						++failures;
+					// lets the writer retire (and try to reclaim) the version while it's being viewed
+					std::this_thread::yield();
+					if (!ConsistentVersion(view.rope(), last))
+						++failures;
+					copy = view.rope();
+				}
+				if (!ConsistentVersion(copy, last))
+					++failures;
+
+				// the snapshot from the last time round is unchanged by the updates since
+				if (held.GetString()!=heldExpected)
+					++failures;
+				held = shared.snapshot();
+				heldExpected = held.GetString();
+				if (!ConsistentVersion(held, last))
+					++failures;
+			}
+		} ) );
+	}
+
+	const size_t blockSize = 8+2*CHUNK_SIZE;
+	const size_t updates = 1000;
+	for(size_t i=0;i!=updates;++i)
+	{
+		shared.update( [i, blockSize](const SharedRope::RopeType& current) {
+			char index[9];
+			snprintf(index, sizeof(index), "%08zu", i);
+			SharedRope::RopeType result = current;
+			result.append(index, 8);
+			const std::string filler(blockSize-8, char('a'+i%26));
+			result.append(filler.data(), filler.size());
+			if (i%2)
+				result.erase(0, blockSize);
+			return result;
+		} );
+		std::this_thread::yield();
+	}
+	done.store(true);
+	for(size_t t=0;t!=readers.size();++t)
+		readers[t].join();
+
+	size_t last = 0;
+	if (failures.load() || !ConsistentVersion(shared.snapshot(), last) || last!=updates || 
+		shared.snapshot().size()!=(updates-updates/2)*blockSize)
+	{
+		printf("ConcurrentRope readers saw %zu inconsistent versions\n", failures.load());
+		return false;
+	}
+	return true;
+}
+
+// counts the nodes alive, to see that teardown frees them
+class CountingAllocator
+{
+	public:
+		static void* Allocate(size_t bytes) {
+			++Live();
+			return ::operator new(bytes);
+		}
+
+		static void Deallocate(void* p, size_t) {
+			--Live();
+			::operator delete(p);
+		}
+
+		static std::atomic<size_t>& Live() {
+			static std::atomic<size_t> live(0);
+			return live;
+		}
+};
+
+// teardown of a 200k leaf left degenerate tree, inline, or through a DeferredReclaimer or a BackgroundReclaimer
+// (each given the tree by the releasing thread). A copy of its deeper half is shared, so must survive, 
+// and everything else must be freed (without recursing, which would overflow the stack at this depth)
+enum TeardownMode { InlineTeardown, DeferredTeardown, BackgroundTeardown };
+
+bool TestTeardown(TeardownMode mode)
+{
+	typedef WCRope::Rope<char, Synchronization::AtomicCount, CountingAllocator> CountedRope;
+	typedef WCRope::StringRep<char, Synchronization::AtomicCount, CountingAllocator> LeafType;
+	typedef WCRope::ConCatRep<char, Synchronization::AtomicCount, CountingAllocator> ConCatType;
+	const size_t leaves = 200000;
+
+	std::string expected;
+	TreeAccess<CountedRope> rope;
+	TreeAccess<CountedRope> survivor;
+	{
+		CountedRope::Ptr tree;
+		for(size_t i=0;i!=leaves;++i)
+		{
+			const char c = char('a'+i%26);
+			const CountedRope::Ptr leaf( LeafType::Create(&c, 1) );
+			tree = tree ? CountedRope::Ptr( new ConCatType(tree, leaf) ) : leaf;
+			expected += c;
+			if (i+1==leaves/2)
+				survivor.SetTree(tree);
+		}
+		rope.SetTree(tree);
+	}
+	if (rope.TreeDepth()!=leaves || !(rope==expected))
+		return false;
+
+	// a leaf and a concatenation for each character that isn't shared
+	const size_t live = CountingAllocator::Live();
+	const size_t freed = 2*(leaves-leaves/2);
+	bool result = true;
+	switch(mode)
+	{
+		case InlineTeardown:
+			rope.clear();
+			break;
+		case DeferredTeardown:
+		{
+			Reclamation::DeferredReclaimer reclaimer;
+			{
+				Reclamation::ReclaimScope scope(reclaimer);
+				rope.clear();
+			}
+			result = reclaimer.Pending()==1 && CountingAllocator::Live()==live && reclaimer.Drain()==1;
+			break;
+		}
+		case BackgroundTeardown:
+		{
+			Reclamation::BackgroundReclaimer reclaimer;
+			{
+				Reclamation::ReclaimScope scope(reclaimer);
+				rope.clear();
+			}
+			reclaimer.Flush();
+			break;
+		}
+	}
+	result = result && CountingAllocator::Live()==live-freed;
+	if (!result)
+		printf("teardown %d didn't free the tree\n", int(mode));
+	if (!(survivor==expected.substr(0, leaves/2)))
+	{
+		printf("teardown %d freed a shared subtree\n", int(mode));
+		result = false;
+	}
+	return result;
+}
+
+// a reverse's reverse shares the string's tree (or the leaf an inline string is promoted to, once), 
+// and a reverse taken before an edit isn't returned after it
+bool TestReverse()
+{
+	typedef TreeAccess<TestReversableRope> ReversableTree;
+	std::string deepExpected;
+	const TestReversableRope deep = DeepRope(deepExpected);
+	const TestReversableRope shortRope("short");
+	if (ReversableTree(deep.reverse().reverse()).Tree()!=ReversableTree(deep).Tree() ||
+		ReversableTree(shortRope.reverse().reverse()).Tree()!=ReversableTree(shortRope.reverse().reverse()).Tree() ||
+		ReversableTree(shortRope.reverse()).Tree()!=ReversableTree(shortRope.reverse()).Tree())
+	{
+		printf("reverse().reverse() doesn't share the string's tree\n");
+		return false;
+	}
+
+	const char* edits[] = { "er", "ened by some way more than the inline capacity" };
+	for(size_t i=0;i!=sizeof(edits)/sizeof(edits[0]);++i)
+	{
+		TestReversableRope edited = i ? deep : shortRope;
+		std::string expected = i ? deepExpected : std::string("short");
+		if (!Matches(edited.reverse(), std::string(expected.rbegin(), expected.rend()), "reverse"))
+			return false;
+		edited += edits[i];
+		expected += edits[i];
+		if (!Matches(edited.reverse(), std::string(expected.rbegin(), expected.rend()), "reverse after an edit") ||
+			!Matches(edited.reverse().reverse(), expected, "reverse of a reverse after an edit") ||
+			std::string(edited.rbegin(), edited.rend())!=std::string(expected.rbegin(), expected.rend()))
+			return false;
+	}
+	return true;
+}
+
+// read_file copies the file, so truncating it afterwards (as log rotation does) leaves the rope as read
+bool TestReadFile()
+{
+	const char* path = "test_read_file.tmp";
+	std::string expected;
+	for(size_t i=0;expected.size()<3*MAPPED_LEAF_SIZE;++i)
+		expected += "line " + std::to_string(i) + "\n";
+
+	FILE* file = fopen(path, "wb");
+	if (!file)
+		return false;
+	fwrite(expected.data(), 1, expected.size(), file);
+	fclose(file);
+
+	bool opened = false;
+	const TestRope rope = TestRope::read_file(path, &opened);
+
+	// truncated to nothing
+	file = fopen(path, "wb");
+	if (file)
+		fclose(file);
+
+	const bool result = opened && rope==expected && rope.GetString()==expected;
+	if (!result)
+		printf("read_file doesn't hold the file's contents as read\n");
+	remove(path);
+
+	TestRope::read_file(path, &opened);
+	if (opened)
+	{
+		printf("read_file opened a missing file\n");
+		return false;
+	}
+	return result;
+}
 
 int main()
 {
  	WCRope::Rope<char, Synchronization::NullMutex> test = "This is a string";
 	WCRope::ReversableRope<char, Synchronization::NullMutex> r = test;
-	
+
 	test = test + " " + r.reverse();
-	
+
 	printf("%s\n", test.GetString().c_str());
+
+	if (!TestReverseTraversal() || !TestEdits() || !TestAppendInPlace() || !TestInline() || !TestReverse() || !TestReadFile() || 
+		!TestConcurrentRope() || !TestTeardown(InlineTeardown) || !TestTeardown(DeferredTeardown) || !TestTeardown(BackgroundTeardown))
+		return 1;
 	return 0;
-}
\ No newline at end of file
+}